@@ -0,0 +1,450 @@
+/*
+ * shell_bench - drive the input-to-output hot path with keystroke traces
+ * and report what it costs.
+ *
+ * Each scenario feeds a trace through shell_feed_char()/shell_run() and
+ * prints one JSON object per line:
+ *
+ *   {"bench":"typing","iters":200,"in_bytes":...,"out_bytes":...,
+ *    "out_calls":...,"ticks":...,"ticks_per_in_byte":...,"max_ticks":...}
+ *
+ * out_calls counts putc_f/write_f invocations. ticks are nanoseconds on a
+ * POSIX host; built with SHELL_BENCH_DWT they are Cortex-M DWT cycles
+ * (the first line says which). max_ticks is the slowest timed event:
+ * one input byte, one Tab press, one dispatched line or one RPC frame.
+ */
+#ifndef SHELL_BENCH_DWT
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "shell.h"
+
+/* ===========================
+ * Tick source
+ * =========================== */
+#ifdef SHELL_BENCH_DWT
+#define DWT_CTRL    (*(volatile uint32_t *)0xE0001000u)
+#define DWT_CYCCNT  (*(volatile uint32_t *)0xE0001004u)
+#define DEMCR       (*(volatile uint32_t *)0xE000EDFCu)
+#define TICK_UNIT   "cycles"
+
+static void tick_init(void)
+{
+    DEMCR |= 1u << 24;      /* TRCENA */
+    DWT_CYCCNT = 0;
+    DWT_CTRL |= 1u;         /* CYCCNTENA */
+}
+
+/* 32-bit counter; a single timed event never gets near a wrap */
+static uint64_t tick_now(void) { return DWT_CYCCNT; }
+static uint64_t tick_diff(uint64_t a, uint64_t b) { return (uint32_t)((uint32_t)b - (uint32_t)a); }
+#else
+#include <time.h>
+#define TICK_UNIT   "ns"
+
+static void tick_init(void) { }
+
+static uint64_t tick_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t tick_diff(uint64_t a, uint64_t b) { return b - a; }
+#endif
+
+/* ===========================
+ * Sink and command tables
+ * =========================== */
+#define MAX_CMDS    1000
+
+static shell_t          g_sh;
+static shell_cmdset_t   g_set;
+static shell_ext_cmd_t  g_cmds[MAX_CMDS];
+static char             g_names[MAX_CMDS][16];
+
+static bool             g_sorted;   /* bench_setup() loads with shell_cmdset_load_sorted() */
+
+static uint32_t g_out_bytes;
+static uint32_t g_out_calls;
+
+static int bench_putc(int ch)
+{
+    g_out_bytes++;
+    g_out_calls++;
+    return ch;
+}
+
+static int bench_write(const uint8_t *buf, size_t len)
+{
+    (void)buf;
+    g_out_bytes += (uint32_t)len;
+    g_out_calls++;
+    return (int)len;
+}
+
+static void cmd_nop(int argc, char **argv, void *user_data)
+{
+    (void)argc; (void)argv; (void)user_data;
+}
+
+#if SHELL_ENABLE_RPC
+/* Echoes its request, so the reply is as long as the request */
+static int rpc_echo(const uint8_t *req, size_t len, uint8_t *resp,
+                    size_t *resp_len, void *user_data)
+{
+    (void)user_data;
+    if (len > *resp_len) len = *resp_len;
+    memcpy(resp, req, len);
+    *resp_len = len;
+    return 0;
+}
+#endif
+
+/* "cmd0000".."cmdNNNN": all share "cm", each is its own leaf */
+static void bench_setup(uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++) {
+        snprintf(g_names[i], sizeof g_names[i], "cmd%04u", (unsigned)i);
+        g_cmds[i].name = g_names[i];
+        g_cmds[i].desc = "";
+        g_cmds[i].fn   = cmd_nop;
+#if SHELL_ENABLE_RPC
+        g_cmds[i].rpc  = rpc_echo;
+#endif
+    }
+
+    shell_init(&g_sh, bench_putc, NULL);
+    shell_set_write(&g_sh, bench_write);
+    if ((g_sorted ? shell_cmdset_load_sorted : shell_cmdset_load_table)(&g_set, g_cmds, count) != SHELL_OK) {
+        printf("{\"error\":\"table of %u commands does not fit\"}\n", (unsigned)count);
+        return;
+    }
+    shell_set_cmdset(&g_sh, &g_set);
+    /* First byte prints the initial prompt; keep it out of the numbers */
+    shell_feed_char(&g_sh, '\x15');
+    shell_run(&g_sh);
+}
+
+/* ===========================
+ * Measurement
+ * =========================== */
+typedef struct {
+    const char *name;
+    uint32_t    iters;
+    uint32_t    in_bytes;
+    uint32_t    out_bytes;
+    uint32_t    out_calls;
+    uint64_t    ticks;
+    uint64_t    max_ticks;
+} bench_result_t;
+
+static void result_begin(bench_result_t *r, const char *name)
+{
+    memset(r, 0, sizeof *r);
+    r->name = name;
+    g_out_bytes = 0;
+    g_out_calls = 0;
+}
+
+static void result_print(bench_result_t *r)
+{
+    r->out_bytes = g_out_bytes;
+    r->out_calls = g_out_calls;
+    printf("{\"bench\":\"%s\",\"iters\":%lu,\"in_bytes\":%lu,\"out_bytes\":%lu,"
+           "\"out_calls\":%lu,\"ticks\":%llu,\"ticks_per_in_byte\":%.1f,"
+           "\"max_ticks\":%llu}\n",
+           r->name, (unsigned long)r->iters, (unsigned long)r->in_bytes,
+           (unsigned long)r->out_bytes, (unsigned long)r->out_calls,
+           (unsigned long long)r->ticks,
+           r->in_bytes ? (double)r->ticks / r->in_bytes : 0.0,
+           (unsigned long long)r->max_ticks);
+}
+
+/* Timed: every byte is one event */
+static void feed_timed(bench_result_t *r, const char *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        uint64_t t0 = tick_now();
+        shell_feed_char(&g_sh, (uint8_t)s[i]);
+        shell_run(&g_sh);
+        uint64_t dt = tick_diff(t0, tick_now());
+        r->ticks += dt;
+        if (dt > r->max_ticks) r->max_ticks = dt;
+    }
+    r->in_bytes += (uint32_t)n;
+}
+
+/* Untimed setup input; its output is not counted either */
+static void feed_quiet(const char *s)
+{
+    uint32_t bytes = g_out_bytes, calls = g_out_calls;
+    for (; *s; s++) {
+        shell_feed_char(&g_sh, (uint8_t)*s);
+        shell_run(&g_sh);
+    }
+    g_out_bytes = bytes;
+    g_out_calls = calls;
+}
+
+/* ===========================
+ * Scenarios
+ * =========================== */
+static void bench_typing(void)
+{
+    static const char line[] = "cmd0007 set gain 12 --channel 3 --verbose\r";
+    bench_result_t r;
+
+    bench_setup(10);
+    result_begin(&r, "typing");
+    for (r.iters = 0; r.iters < 200; r.iters++)
+        feed_timed(&r, line, sizeof line - 1);
+    result_print(&r);
+}
+
+static void bench_paste(void)
+{
+    char raw[SHELL_LINEBUF_SIZE], bracketed[SHELL_LINEBUF_SIZE + 16];
+    bench_result_t r;
+
+    memset(raw, 'p', sizeof raw - 1);
+    raw[sizeof raw - 1] = '\0';
+    snprintf(bracketed, sizeof bracketed, "\033[200~%s\033[201~", raw);
+
+    bench_setup(10);
+    result_begin(&r, "paste_raw");
+    for (r.iters = 0; r.iters < 200; r.iters++) {
+        feed_timed(&r, raw, strlen(raw));
+        feed_quiet("\x15");
+    }
+    result_print(&r);
+
+    result_begin(&r, "paste_bracketed");
+    for (r.iters = 0; r.iters < 200; r.iters++) {
+        feed_timed(&r, bracketed, strlen(bracketed));
+        feed_quiet("\x15");
+    }
+    result_print(&r);
+}
+
+static void bench_history(void)
+{
+    char line[32];
+    bench_result_t r;
+
+    bench_setup(10);
+    for (unsigned i = 0; i < 64; i++) {
+        snprintf(line, sizeof line, "cmd%04u arg%u\r", i % 10, i);
+        feed_quiet(line);
+    }
+
+    result_begin(&r, "history_scroll");
+    for (r.iters = 0; r.iters < 100; r.iters++) {
+        for (int k = 0; k < 16; k++) feed_timed(&r, "\033[A", 3);
+        for (int k = 0; k < 16; k++) feed_timed(&r, "\033[B", 3);
+    }
+    result_print(&r);
+}
+
+/* Tab on a unique name (completes) and on the shared prefix (lists) */
+static void bench_tab(uint16_t count)
+{
+    char name[32], unique[16];
+    bench_result_t r;
+
+    bench_setup(count);
+    snprintf(unique, sizeof unique, "cmd%04u", (unsigned)(count - 1));
+
+    snprintf(name, sizeof name, "tab_%u_complete", (unsigned)count);
+    result_begin(&r, name);
+    for (r.iters = 0; r.iters < 200; r.iters++) {
+        feed_quiet(unique);
+        feed_timed(&r, "\t", 1);
+        feed_quiet("\x15");
+    }
+    result_print(&r);
+
+    snprintf(name, sizeof name, "tab_%u_list", (unsigned)count);
+    result_begin(&r, name);
+    for (r.iters = 0; r.iters < 20; r.iters++) {
+        feed_quiet("cm\t"); /* Extends to the common prefix */
+        feed_timed(&r, "\t", 1);
+        feed_quiet("\x15");
+    }
+    result_print(&r);
+}
+
+/* A full line edited in the middle, where every insert shifts the tail;
+ * with a width set the line wraps and the shift carries across rows */
+static void bench_long_line(uint16_t cols)
+{
+    char fill[SHELL_LINEBUF_SIZE], name[32];
+    bench_result_t r;
+
+    memset(fill, 'x', sizeof fill - 1);
+    fill[sizeof fill - 1] = '\0';
+    fill[sizeof fill / 2] = '\0';
+
+    bench_setup(10);
+    shell_set_term_width(&g_sh, cols);
+    if (cols)
+        snprintf(name, sizeof name, "long_line_edit_%u_cols", (unsigned)cols);
+    else
+        snprintf(name, sizeof name, "long_line_edit");
+    result_begin(&r, name);
+    for (r.iters = 0; r.iters < 100; r.iters++) {
+        feed_quiet(fill);
+        feed_quiet(fill);
+        for (int k = 0; k < 20; k++) feed_timed(&r, "\033[D", 3);
+        for (int k = 0; k < 20; k++) feed_timed(&r, "\b", 1);
+        for (int k = 0; k < 20; k++) feed_timed(&r, "y", 1);
+        feed_timed(&r, "\001\005", 2);
+        feed_quiet("\x15");
+    }
+    result_print(&r);
+}
+
+/* Name lookup and dispatch without the editor, one line per event */
+static void bench_lookup(uint16_t count)
+{
+    char name[32], line[16];
+    bench_result_t r;
+
+    bench_setup(count);
+    snprintf(name, sizeof name, g_sorted ? "lookup_sorted_%u" : "lookup_%u", (unsigned)count);
+    result_begin(&r, name);
+    for (r.iters = 0; r.iters < 2000; r.iters++) {
+        int n = snprintf(line, sizeof line, "cmd%04u",
+                         (unsigned)((r.iters * 7919u) % count));
+        uint64_t t0 = tick_now();
+        shell_exec_script(&g_sh, line, (size_t)n);
+        uint64_t dt = tick_diff(t0, tick_now());
+        r.ticks += dt;
+        if (dt > r.max_ticks) r.max_ticks = dt;
+        r.in_bytes += (uint32_t)n;
+    }
+    result_print(&r);
+}
+
+/* Enter on a mistyped name: "Command not found" plus the suggestion */
+static void bench_miss(uint16_t count)
+{
+    char name[32], line[16];
+    bench_result_t r;
+
+    bench_setup(count);
+    snprintf(name, sizeof name, "miss_%u", (unsigned)count);
+    result_begin(&r, name);
+    for (r.iters = 0; r.iters < 200; r.iters++) {
+        snprintf(line, sizeof line, "cmd%04uz", (unsigned)((r.iters * 7919u) % count));
+        feed_quiet(line);
+        feed_timed(&r, "\r", 1);
+    }
+    result_print(&r);
+}
+
+/* Boot cost: building the trie against checking a sorted table */
+static void bench_load(uint16_t count)
+{
+    char name[32];
+    bench_result_t r;
+
+    bench_setup(count);
+    for (int sorted = 0; sorted < 2; sorted++) {
+        snprintf(name, sizeof name, sorted ? "load_sorted_%u" : "load_trie_%u",
+                 (unsigned)count);
+        result_begin(&r, name);
+        for (r.iters = 0; r.iters < 50; r.iters++) {
+            uint64_t t0 = tick_now();
+            if (sorted)
+                shell_cmdset_load_sorted(&g_set, g_cmds, count);
+            else
+                shell_cmdset_load_table(&g_set, g_cmds, count);
+            uint64_t dt = tick_diff(t0, tick_now());
+            r.ticks += dt;
+            if (dt > r.max_ticks) r.max_ticks = dt;
+        }
+        result_print(&r);
+    }
+}
+
+#if SHELL_ENABLE_RPC
+static uint16_t rpc_crc16(uint16_t crc, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        crc ^= (uint16_t)(*p++ << 8);
+        for (int b = 0; b < 8; b++)
+            crc = (uint16_t)((crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1);
+    }
+    return crc;
+}
+
+/* The same lookups as binary frames with an 8-byte payload */
+static void bench_rpc(uint16_t count)
+{
+    char name[32];
+    uint8_t f[15];
+    bench_result_t r;
+
+    bench_setup(count);
+    shell_set_rpc(&g_sh, true);
+    snprintf(name, sizeof name, "rpc_%u", (unsigned)count);
+    result_begin(&r, name);
+    for (r.iters = 0; r.iters < 2000; r.iters++) {
+        uint16_t id = (uint16_t)((r.iters * 7919u) % count);
+        f[0] = SHELL_RPC_SOF;
+        f[1] = (uint8_t)r.iters;
+        f[2] = (uint8_t)id;
+        f[3] = (uint8_t)(id >> 8);
+        f[4] = 8;
+        memcpy(f + 5, "payload!", 8);
+        uint16_t crc = rpc_crc16(0xFFFF, f + 1, 12);
+        f[13] = (uint8_t)crc;
+        f[14] = (uint8_t)(crc >> 8);
+
+        uint64_t t0 = tick_now();
+        shell_feed_buf(&g_sh, f, sizeof f);
+        shell_run(&g_sh);
+        uint64_t dt = tick_diff(t0, tick_now());
+        r.ticks += dt;
+        if (dt > r.max_ticks) r.max_ticks = dt;
+        r.in_bytes += sizeof f;
+    }
+    result_print(&r);
+}
+#endif
+
+int main(void)
+{
+    static const uint16_t sizes[] = { 10, 100, 1000 };
+
+    tick_init();
+    printf("{\"suite\":\"tiny-shell\",\"unit\":\"%s\",\"linebuf\":%u}\n",
+           TICK_UNIT, (unsigned)SHELL_LINEBUF_SIZE);
+
+    bench_typing();
+    bench_paste();
+    bench_history();
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+        bench_tab(sizes[i]);
+    bench_long_line(0);
+    bench_long_line(80);
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+        bench_lookup(sizes[i]);
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+        bench_miss(sizes[i]);
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+        bench_load(sizes[i]);
+    g_sorted = true;
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+        bench_lookup(sizes[i]);
+    g_sorted = false;
+#if SHELL_ENABLE_RPC
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+        bench_rpc(sizes[i]);
+#endif
+    return 0;
+}
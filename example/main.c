@@ -49,6 +49,13 @@ static int my_putchar(int ch)
     return fputc(ch, stdout);
 }
 
+static int my_write(const uint8_t* buf, size_t len)
+{
+    size_t n = fwrite(buf, 1, len, stdout);
+    fflush(stdout);
+    return (int)n;
+}
+
 // === Shell Commands ===
 static shell_t g_shell;
 
@@ -58,6 +65,8 @@ static void cmd_help(int argc, char** argv, void* user_data)
     printf("  help     - Show this help\n");
     printf("  echo     - Echo arguments\n");
     printf("  clear    - Clear screen\n");
+    printf("  led      - Set the LED: led on|off|blink [<period ms>] [-q]\n");
+    printf("  gpio     - GPIO pins: gpio set <pin> <0|1>, gpio get <pin>\n");
     printf("  stats    - Show shell stats\n");
     printf("  exit     - Exit the shell\n");
 }
@@ -76,20 +85,60 @@ static void cmd_clear(int argc, char** argv, void* user_data)
     shell_clear_screen(&g_shell);
 }
 
-static void cmd_stats(int argc, char** argv, void* user_data)
+// Typed arguments: the shell checks and converts them before the call
+static const char* const led_modes[] = { "on", "off", "blink", NULL };
+static const shell_arg_spec_t led_args[] =
+{
+    { .name = "mode",   .type = SHELL_ARG_ENUM, .choices = led_modes },
+    { .name = "period", .type = SHELL_ARG_INT,  .min = 10, .max = 5000, .optional = true },
+    { .name = "-q",     .type = SHELL_ARG_FLAG },
+};
+
+static int cmd_led(const shell_args_t* args, void* user_data)
+{
+    int period = SHELL_ARG_GIVEN(args, 1) ? args->v[1].i : 500;
+    if(!args->v[2].b)
+    {
+        printf("LED %s", led_modes[args->v[0].u]);
+        if(args->v[0].u == 2) printf(", %d ms", period);
+        printf("\n");
+    }
+    return 0;
+}
+
+// A command group: "gpio set 3 1" runs set from its own table
+static uint8_t g_gpio_levels[32];
+
+static const shell_arg_spec_t gpio_set_args[] =
 {
-    shell_stats_t stats;
+    { .name = "pin",   .type = SHELL_ARG_INT, .min = 0, .max = 31 },
+    { .name = "level", .type = SHELL_ARG_INT, .min = 0, .max = 1  },
+};
 
-    shell_get_stats(&g_shell, &stats);
+static const shell_arg_spec_t gpio_get_args[] =
+{
+    { .name = "pin",   .type = SHELL_ARG_INT, .min = 0, .max = 31 },
+};
 
-    printf("Shell Statistics:\n");
-    printf("  History: %u / %u\n", stats.history_count, SHELL_HISTORY_SIZE);
-    printf("  Commands: %u\n", stats.cmd_count);
-    printf("  Keybinds: %u / %u\n", stats.keybind_count, SHELL_MAX_KEYBINDS);
-    printf("  ART Nodes: %u / %u\n", stats.max_nodes_used, SHELL_ART_MAX_NODES);
-    printf("  ART Overflow: %s\n", stats.art_overflow ? "YES" : "no");
+static int cmd_gpio_set(const shell_args_t* args, void* user_data)
+{
+    g_gpio_levels[args->v[0].i] = (uint8_t)args->v[1].i;
+    return 0;
 }
 
+static int cmd_gpio_get(const shell_args_t* args, void* user_data)
+{
+    printf("%d\n", g_gpio_levels[args->v[0].i]);
+    return 0;
+}
+
+static const shell_ext_cmd_t g_gpio_commands[] =
+{
+    SHELL_CMD_ARGS("set", "Drive a pin", gpio_set_args, cmd_gpio_set, NULL),
+    SHELL_CMD_ARGS("get", "Read a pin",  gpio_get_args, cmd_gpio_get, NULL),
+};
+static shell_cmdset_t g_gpio_set;
+
 static void cmd_exit(int argc, char** argv, void* user_data)
 {
     exit(0);
@@ -98,13 +147,21 @@ static void cmd_exit(int argc, char** argv, void* user_data)
 // === Command Table ===
 static const shell_ext_cmd_t g_commands[] =
 {
-    { "help",  "Show available commands", cmd_help,  &g_shell },
-    { "echo",  "Echo arguments",          cmd_echo,  NULL     },
-    { "clear", "Clear the screen",        cmd_clear, &g_shell },
-    { "stats", "Show shell statistics",   cmd_stats, &g_shell },
-    { "exit",  "Exit the shell",          cmd_exit,  NULL     },
+    { .name = "help",  .desc = "Show available commands", .fn = cmd_help,  .user_data = &g_shell },
+    { .name = "echo",  .desc = "Echo arguments",          .fn = cmd_echo                         },
+    { .name = "clear", .desc = "Clear the screen",        .fn = cmd_clear, .user_data = &g_shell },
+    SHELL_CMD("stats", "Show shell statistics", shell_cmd_stats, &g_shell),
+    SHELL_CMD_ARGS("led", "Set the LED", led_args, cmd_led, NULL),
+    SHELL_CMD_GROUP("gpio", "GPIO pins", &g_gpio_set),
+    { .name = "exit",  .desc = "Exit the shell",          .fn = cmd_exit                         },
 };
 static const uint16_t CMD_COUNT = sizeof(g_commands) / sizeof(g_commands[0]);
+static shell_cmdset_t g_cmds;
+
+#ifdef EXAMPLE_PREBUILT_TRIE
+// Generated from commands.txt at build time
+extern const shell_art_prebuilt_t g_commands_trie;
+#endif
 
 
 // === Main ===
@@ -121,12 +178,27 @@ int main(void)
         return 1;
     }
 
-    status = shell_load_table(&g_shell, g_commands, CMD_COUNT);
+    shell_set_write(&g_shell, my_write);
+
+    status = shell_cmdset_load_table(&g_gpio_set, g_gpio_commands,
+                                     sizeof(g_gpio_commands) / sizeof(g_gpio_commands[0]));
+    if(status != SHELL_OK)
+    {
+        fprintf(stderr, "loading the gpio table failed: %d\n", status);
+        return 1;
+    }
+
+#ifdef EXAMPLE_PREBUILT_TRIE
+    status = shell_cmdset_load_prebuilt_trie(&g_cmds, g_commands, CMD_COUNT, &g_commands_trie);
+#else
+    status = shell_cmdset_load_table(&g_cmds, g_commands, CMD_COUNT);
+#endif
     if(status != SHELL_OK)
     {
-        fprintf(stderr, "shell_load_table failed: %d\n", status);
+        fprintf(stderr, "loading the command table failed: %d\n", status);
         return 1;
     }
+    shell_set_cmdset(&g_shell, &g_cmds);
 
     printf("===========================================\n");
     printf("  tiny-shell Host Example (Raw Mode)\n");
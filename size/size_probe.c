@@ -0,0 +1,8 @@
+/*
+ * One shell_t in .bss: the bss column of this object is sizeof(shell_t)
+ * for the profile's configuration, even when the target cannot run code.
+ * The explicit initializer keeps it out of COMMON.
+ */
+#include "shell.h"
+
+shell_t shell_size_probe = { 0 };
@@ -0,0 +1,57 @@
+# cmake -DSIZE_TOOL=<size> -DPROFILES="name=lib.a|..." -P size_report.cmake
+#
+# Reads the Berkeley-format output of size for each profile library and
+# prints one row per profile.
+string(REPLACE "|" ";" PROFILES "${PROFILES}")
+
+# Pad value to |width| columns: right-aligned, or left-aligned if negative
+function(pad value width out)
+    set(s "${value}")
+    string(LENGTH "${s}" n)
+    if(width LESS 0)
+        math(EXPR width "-(${width})")
+        while(n LESS width)
+            set(s "${s} ")
+            math(EXPR n "${n} + 1")
+        endwhile()
+    else()
+        while(n LESS width)
+            set(s " ${s}")
+            math(EXPR n "${n} + 1")
+        endwhile()
+    endif()
+    set(${out} "${s}" PARENT_SCOPE)
+endfunction()
+
+pad("profile" -13 c1)
+pad("sizeof(shell_t)" 15 c2)
+pad("text (shell.c)" 17 c3)
+message("${c1}${c2}${c3}")
+foreach(entry ${PROFILES})
+    string(REGEX MATCH "^([^=]+)=(.*)$" _ "${entry}")
+    set(name ${CMAKE_MATCH_1})
+    set(lib  ${CMAKE_MATCH_2})
+
+    execute_process(COMMAND ${SIZE_TOOL} ${lib}
+                    OUTPUT_VARIABLE out RESULT_VARIABLE rc)
+    if(NOT rc EQUAL 0)
+        message(FATAL_ERROR "${SIZE_TOOL} failed on ${lib}")
+    endif()
+
+    # text data bss dec hex filename
+    set(state "?")
+    set(text  "?")
+    string(REPLACE "\n" ";" lines "${out}")
+    foreach(line ${lines})
+        if(line MATCHES "^[ \t]*([0-9]+)[ \t]+[0-9]+[ \t]+([0-9]+)[ \t]+.*size_probe")
+            set(state ${CMAKE_MATCH_2})
+        elseif(line MATCHES "^[ \t]*([0-9]+)[ \t]+.*shell\\.c")
+            set(text ${CMAKE_MATCH_1})
+        endif()
+    endforeach()
+
+    pad("${name}" -13 c1)
+    pad("${state}" 15 c2)
+    pad("${text}" 17 c3)
+    message("${c1}${c2}${c3}")
+endforeach()
@@ -1,6 +1,11 @@
 #include "shell.h"
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 
 /* ANSI Escape Codes */
 #define ANSI_CLEAR_LINE_FROM_CURSOR "\033[K"
@@ -8,6 +13,10 @@
 #define ANSI_CLEAR_SCREEN           "\033[2J"
 #define ANSI_MOVE_CURSOR_RIGHT(n)   "\033[" #n "C"
 #define ANSI_MOVE_CURSOR_COL(n)     "\033[" #n "G"
+#define ANSI_BRACKETED_PASTE_ON     "\033[?2004h"
+#define ANSI_CLEAR_BELOW            "\033[J"
+/* Save the cursor, park it in the last column, report it, restore */
+#define ANSI_QUERY_WIDTH            "\0337\033[999C\033[6n\0338"
 
 /* ===========================
  * Internal key codes
@@ -16,17 +25,189 @@ typedef enum {
     SH_PARSE_NONE = 0,
     SH_PARSE_CONTINUE,
     SH_PARSE_COMPLETE,
+    SH_PARSE_PASTE_BEGIN,
+    SH_PARSE_PASTE_END,
 } sh_parse_result_t;
 
+/* Metrics hooks compile away without SHELL_ENABLE_METRICS */
+#if SHELL_ENABLE_METRICS
+#define MT_ADD(sh, field, n) ((sh)->metrics.field += (uint32_t)(n))
+#else
+#define MT_ADD(sh, field, n) ((void)0)
+#endif
+
 /* ===========================
  * Small I/O helpers
  * =========================== */
+#if SHELL_FEATURE_CAPTURE
+#define SH_CAPTURING(sh) ((sh)->cap_buf != NULL)
+
+/* During shell_exec_capture() the caller's buffer is the sink. It takes
+ * everything; what no longer fits is only counted. */
+static void sh_cap_put(shell_t *sh, const uint8_t *s, size_t len) {
+    size_t kept = sh->cap_len < sh->cap_size - 1 ? sh->cap_len : sh->cap_size - 1;
+    size_t n = sh->cap_size - 1 - kept;
+    if (n > len) n = len;
+    memcpy(sh->cap_buf + kept, s, n);
+    sh->cap_len += len;
+}
+#else
+#define SH_CAPTURING(sh) false
+#endif
+
+/* Hand a run straight to the sink */
+static void sh_sink(shell_t *sh, const uint8_t *s, size_t len) {
+#if SHELL_FEATURE_CAPTURE
+    if (sh->cap_buf) {
+        sh_cap_put(sh, s, len);
+        return;
+    }
+#endif
+    if (sh->write_f) {
+        sh->write_f(s, len);
+    } else {
+        while (len--) sh->putc_f(*s++);
+    }
+}
+
+#if SHELL_TX_RING_SIZE > 0
+/* Hand queued bytes to the sink until it is empty or the sink stalls.
+ * With wait set, keep offering until at least one byte was taken, but
+ * only SHELL_TX_STALL_TRIES times: false means the sink never moved. */
+static bool sh_tx_drain(shell_t *sh, bool wait) {
+    uint16_t tries = 0;
+    while (sh->tx_len) {
+        uint16_t chunk = (uint16_t)(SHELL_TX_RING_SIZE - sh->tx_tail);
+        if (chunk > sh->tx_len) chunk = sh->tx_len;
+
+        int n;
+        if (SH_CAPTURING(sh)) {
+            sh_sink(sh, &sh->tx_ring[sh->tx_tail], chunk);
+            n = chunk;
+        } else if (sh->write_f) {
+            n = sh->write_f(&sh->tx_ring[sh->tx_tail], chunk);
+            if (n > chunk) n = chunk;
+        } else {
+            for (n = 0; n < chunk; n++)
+                if (sh->putc_f(sh->tx_ring[sh->tx_tail + n]) < 0)
+                    break;
+        }
+        if (n <= 0) {
+            if (wait && ++tries < SHELL_TX_STALL_TRIES) continue;
+            return !wait;
+        }
+        sh->tx_tail = (uint16_t)((sh->tx_tail + n) % SHELL_TX_RING_SIZE);
+        sh->tx_len  = (uint16_t)(sh->tx_len - n);
+        wait = false;
+    }
+    return true;
+}
+
+/* Copy up to len bytes into the ring; returns how many fit */
+static size_t sh_tx_put(shell_t *sh, const uint8_t *s, size_t len) {
+    size_t done = 0;
+    while (done < len && sh->tx_len < SHELL_TX_RING_SIZE) {
+        uint16_t head = (uint16_t)((sh->tx_tail + sh->tx_len) % SHELL_TX_RING_SIZE);
+        size_t n = (size_t)(head >= sh->tx_tail ? SHELL_TX_RING_SIZE - head
+                                                : sh->tx_tail - head);
+        if (n > len - done) n = len - done;
+        memcpy(&sh->tx_ring[head], s + done, n);
+        sh->tx_len = (uint16_t)(sh->tx_len + n);
+        done += n;
+    }
+    MT_ADD(sh, out_bytes, done);
+    return done;
+}
+#endif
+
+static void sh_flush(shell_t *sh) {
+#if SHELL_TX_RING_SIZE > 0
+    sh_tx_drain(sh, false);
+#elif SHELL_OUTBUF_SIZE > 0
+    if (sh->out_len == 0) return;
+    sh_sink(sh, sh->outbuf, sh->out_len);
+    sh->out_len = 0;
+#else
+    (void)sh;
+#endif
+}
+
+/* Stage a run of bytes; large runs bypass the staging buffer. The shell's
+ * own output should not be dropped, so a full TX ring is waited on, up to
+ * the point where the sink has plainly stopped taking anything. */
+static void sh_write(shell_t *sh, const char *s, size_t len) {
+#if SHELL_TX_RING_SIZE > 0
+    for (;;) {
+        size_t n = sh_tx_put(sh, (const uint8_t *)s, len);
+        s += n;
+        len -= n;
+        if (!len) return;
+        if (!sh_tx_drain(sh, true)) {
+            MT_ADD(sh, tx_drops, len);
+            return;
+        }
+    }
+#elif SHELL_OUTBUF_SIZE > 0
+    MT_ADD(sh, out_bytes, len);
+    if (sh->write_f && len >= SHELL_OUTBUF_SIZE) {
+        sh_flush(sh);
+        sh_sink(sh, (const uint8_t *)s, len);
+        return;
+    }
+    while (len) {
+        if (sh->out_len >= SHELL_OUTBUF_SIZE)
+            sh_flush(sh);
+        size_t n = SHELL_OUTBUF_SIZE - sh->out_len;
+        if (n > len) n = len;
+        memcpy(&sh->outbuf[sh->out_len], s, n);
+        sh->out_len = (uint16_t)(sh->out_len + n);
+        s += n;
+        len -= n;
+    }
+#else
+    MT_ADD(sh, out_bytes, len);
+    sh_sink(sh, (const uint8_t *)s, len);
+#endif
+}
+
 static void sh_putc(shell_t *sh, char c) {
-    sh->putc_f((unsigned char)c);
+#if SHELL_TX_RING_SIZE > 0
+    sh_write(sh, &c, 1);
+#elif SHELL_OUTBUF_SIZE > 0
+    MT_ADD(sh, out_bytes, 1);
+    if (sh->out_len >= SHELL_OUTBUF_SIZE)
+        sh_flush(sh);
+    sh->outbuf[sh->out_len++] = (uint8_t)c;
+#else
+    MT_ADD(sh, out_bytes, 1);
+    uint8_t b = (uint8_t)c;
+    sh_sink(sh, &b, 1);
+#endif
+}
+
+/* Optional lock from shell_set_lock(). shell_run() holds it while it
+ * works and drops it around user callbacks, which may call the locked
+ * API themselves. */
+static void sh_lock(shell_t *sh) {
+    if (sh->lock_f) sh->lock_f(sh->lock_ctx);
+}
+
+static void sh_unlock(shell_t *sh) {
+    if (sh->unlock_f) sh->unlock_f(sh->lock_ctx);
+}
+
+/* Hand control to user code: publish staged output, drop the lock */
+static void sh_callout_begin(shell_t *sh) {
+    sh_flush(sh);
+    sh_unlock(sh);
+}
+
+static void sh_callout_end(shell_t *sh) {
+    sh_lock(sh);
 }
 
 static void sh_puts(shell_t *sh, const char *s) {
-    while (*s) sh_putc(sh, *s++);
+    sh_write(sh, s, strlen(s));
 }
 
 /* Helper to print an unsigned integer without stdio */
@@ -48,158 +229,1437 @@ static void sh_puts_uint(shell_t *sh, unsigned int n) {
 static void sh_prompt(shell_t *sh) {
     sh->prompt_len = 2; /* "> " */
     sh_puts(sh, "> ");
+    sh->term_len    = 0;
+    sh->term_cursor = 0;
+}
+
+/* ===========================
+ * Differential renderer
+ *
+ * term_len/term_cursor mirror the terminal. linebuf[0..term_len) is what
+ * is on screen, so each edit only has to emit the bytes that changed.
+ *
+ * Once the width is known the line may wrap. A position is then its
+ * column counted from the start of the prompt, split into row and
+ * column by the width. A write that just filled a row leaves the
+ * terminal waiting to wrap; sh_emit() settles that at once with \r\n,
+ * so the cursor is always where the arithmetic says, and the row after
+ * a full last row exists for CSI B to reach.
+ * =========================== */
+
+/* Emit CSI <n> <final>, omitting n when it is the default of 1 */
+static void sh_csi(shell_t *sh, unsigned int n, char final)
+{
+    sh_putc(sh, '\033');
+    sh_putc(sh, '[');
+    if (n != 1) sh_puts_uint(sh, n);
+    sh_putc(sh, final);
+}
+
+#if SHELL_FEATURE_WRAP
+#define SH_TERM_COLS(sh) ((unsigned)(sh)->term_cols)
+#else
+#define SH_TERM_COLS(sh) 0u
+#endif
+
+/* Wrap width for cursor math, 0 while unknown or too narrow for the
+ * prompt; the line is then treated as one row */
+static inline unsigned sh_cols(const shell_t *sh)
+{
+#if SHELL_FEATURE_WRAP
+    return sh->term_cols > sh->prompt_len ? sh->term_cols : 0;
+#else
+    (void)sh;
+    return 0;
+#endif
+}
+
+/* Move between two columns counted from the start of the prompt */
+static void sh_goto(shell_t *sh, unsigned from, unsigned to)
+{
+    unsigned cols = sh_cols(sh);
+    if (cols) {
+        unsigned fr = from / cols, tr = to / cols;
+        if (tr < fr)      sh_csi(sh, fr - tr, 'A');
+        else if (tr > fr) sh_csi(sh, tr - fr, 'B');
+        from %= cols;
+        to   %= cols;
+    }
+    if (to == 0 && from > 0) {
+        sh_putc(sh, '\r');
+    } else if (to < from) {
+        unsigned d = from - to;
+        if (d <= 3) {
+            while (d--) sh_putc(sh, '\b');
+        } else {
+            sh_csi(sh, d, 'D');
+        }
+    } else if (to > from) {
+        sh_csi(sh, to - from, 'C');
+    }
+}
+
+/* Move the terminal cursor to a line offset, picking the shortest encoding */
+static void sh_move_cursor(shell_t *sh, uint16_t to)
+{
+    uint16_t cur = sh->term_cursor;
+    unsigned cols = sh_cols(sh), p = sh->prompt_len;
+
+    if (to > cur && to - cur <= 3 && (!cols || (p + cur) / cols == (p + to) / cols)) {
+        /* Re-printing what is already there is cheaper than CSI n C */
+        sh_write(sh, &sh->linebuf[cur], (size_t)(to - cur));
+    } else {
+        sh_goto(sh, p + cur, p + to);
+    }
+    sh->term_cursor = to;
+}
+
+/* Print linebuf[pos, pos+n) with the cursor at pos */
+static void sh_emit(shell_t *sh, uint16_t pos, uint16_t n)
+{
+    unsigned cols = sh_cols(sh);
+    sh_write(sh, &sh->linebuf[pos], n);
+    sh->term_cursor = (uint16_t)(pos + n);
+    if (cols && n && (sh->prompt_len + pos + n) % cols == 0)
+        sh_puts(sh, "\r\n");
+}
+
+/* Rows below the cursor's: \r\n reaches the next one even when it has to
+ * scroll it into view */
+static void sh_next_row(shell_t *sh, unsigned start)
+{
+    if (sh->prompt_len + sh->term_cursor != start) {
+        sh_puts(sh, "\r\n");
+        sh->term_cursor = (uint16_t)(start - sh->prompt_len);
+    }
+}
+
+/* linebuf gained n (< cols) chars at pos and the text after it spills
+ * into later rows. Each row shifts right in place (CSI n @) and gets the
+ * n chars the row above pushed out, so nothing is repainted whole. */
+static void sh_carry_insert(shell_t *sh, uint16_t pos, uint16_t n, unsigned cols)
+{
+    unsigned p = sh->prompt_len, a = p + pos, end = p + sh->line_len;
+    unsigned s = a - a % cols + cols; /* Start of the next row */
+
+    if (a + n < s) {
+        sh_csi(sh, n, '@');
+        sh_emit(sh, pos, n);
+    } else {
+        sh_emit(sh, pos, (uint16_t)(s - a));
+    }
+    for (; s <= end; s += cols) {
+        uint16_t k = (uint16_t)(end - s < n ? end - s : n);
+        sh_next_row(sh, s);
+        if (k) {
+            sh_csi(sh, n, '@');
+            sh_emit(sh, (uint16_t)(s - p), k);
+        }
+    }
+}
+
+/* linebuf lost n (< cols) chars at pos, and the old text went on past
+ * this row: each row shifts left (CSI n P) and its last n columns are
+ * filled from the row below. Whatever is left under the new end is
+ * cleared in one go. */
+static void sh_carry_delete(shell_t *sh, uint16_t pos, uint16_t n, unsigned cols)
+{
+    unsigned p = sh->prompt_len, a = p + pos, end = p + sh->line_len;
+    unsigned old_end = p + sh->term_len;
+    unsigned s = a - a % cols;
+
+    for (;;) {
+        unsigned next = s + cols;
+        unsigned fill = next - n; /* Where the row below comes in */
+        if (a < fill) {
+            sh_csi(sh, n, 'P');
+        } else {
+            fill = a;
+        }
+        if (end > fill) {
+            sh_goto(sh, a, fill);
+            sh->term_cursor = (uint16_t)(fill - p);
+            sh_emit(sh, (uint16_t)(fill - p), (uint16_t)((end < next ? end : next) - fill));
+        }
+        if (end <= next) {
+            if (old_end > next)
+                sh_puts(sh, ANSI_CLEAR_BELOW);
+            return;
+        }
+        sh_next_row(sh, next);
+        s = a = next;
+    }
+}
+
+/* linebuf gained n chars at pos */
+static void sh_render_insert(shell_t *sh, uint16_t pos, uint16_t n)
+{
+    if (!sh->echo_enabled || n == 0) return;
+    unsigned cols = sh_cols(sh), a = sh->prompt_len + pos;
+    sh_move_cursor(sh, pos);
+    if (pos >= sh->term_len) {
+        sh_emit(sh, pos, n);
+    } else if (!cols || sh->prompt_len + sh->line_len < a - a % cols + cols) {
+        sh_csi(sh, n, '@');
+        sh_emit(sh, pos, n);
+    } else if (n < cols) {
+        sh_carry_insert(sh, pos, n, cols);
+    } else {
+        sh_emit(sh, pos, (uint16_t)(sh->line_len - pos));
+    }
+    sh->term_len = (uint16_t)(sh->term_len + n);
+    sh_move_cursor(sh, sh->cursor_pos);
+}
+
+/* linebuf lost n chars at pos */
+static void sh_render_delete(shell_t *sh, uint16_t pos, uint16_t n)
+{
+    if (!sh->echo_enabled || n == 0) return;
+    unsigned cols = sh_cols(sh), a = sh->prompt_len + pos;
+    sh_move_cursor(sh, pos);
+    if (!cols || sh->prompt_len + sh->term_len <= a - a % cols + cols) {
+        if (pos + n >= sh->term_len) {
+            sh_puts(sh, ANSI_CLEAR_LINE_FROM_CURSOR);
+        } else {
+            sh_csi(sh, n, 'P');
+        }
+    } else if (n < cols) {
+        sh_carry_delete(sh, pos, n, cols);
+    } else {
+        sh_emit(sh, pos, (uint16_t)(sh->line_len - pos));
+        sh_puts(sh, ANSI_CLEAR_BELOW);
+    }
+    sh->term_len = (uint16_t)(sh->term_len - n);
+    sh_move_cursor(sh, sh->cursor_pos);
+}
+
+/* linebuf[pos..pos+n) was overwritten in place */
+static void sh_render_replace(shell_t *sh, uint16_t pos, uint16_t n)
+{
+    if (!sh->echo_enabled || n == 0) return;
+    sh_move_cursor(sh, pos);
+    sh_emit(sh, pos, n);
+    sh_move_cursor(sh, sh->cursor_pos);
+}
+
+/* Before output below the line: the cursor goes to the line's last row */
+static void sh_render_leave(shell_t *sh)
+{
+    if (sh->echo_enabled && sh_cols(sh))
+        sh_move_cursor(sh, sh->term_len);
+}
+
+#if SHELL_FEATURE_HISTORY
+/* Replace the whole line, only repainting from the first differing char */
+static void sh_render_set_line(shell_t *sh, const char *line)
+{
+    uint16_t keep = 0;
+    while (keep < sh->line_len && line[keep] && line[keep] == sh->linebuf[keep])
+        keep++;
+
+    size_t len = strlen(line);
+    if (len > SHELL_LINEBUF_SIZE - 1) len = SHELL_LINEBUF_SIZE - 1;
+    memmove(sh->linebuf, line, len);
+    sh->linebuf[len] = '\0';
+    sh->line_len   = (uint16_t)len;
+    sh->cursor_pos = sh->line_len;
+
+    if (!sh->echo_enabled) return;
+    sh_move_cursor(sh, keep);
+    sh_emit(sh, keep, (uint16_t)(sh->line_len - keep));
+    if (sh->term_len > sh->line_len)
+        sh_puts(sh, sh_cols(sh) ? ANSI_CLEAR_BELOW : ANSI_CLEAR_LINE_FROM_CURSOR);
+    sh->term_len = sh->line_len;
 }
+#endif
 
 /* ===========================
  * Input queue (SPSC)
+ *
+ * The producer owns in_head, the consumer owns in_tail. Each side reads
+ * the other's index with acquire and publishes its own with release, so
+ * queued bytes are visible before the index that covers them.
  * =========================== */
+#define SH_QMASK (SHELL_INPUT_QUEUE_SIZE - 1)
+
+typedef char sh_queue_size_is_pow2[(SHELL_INPUT_QUEUE_SIZE & SH_QMASK) == 0 ? 1 : -1];
+
+#if defined(__GNUC__) || defined(__clang__)
+#define sh_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define sh_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+static inline uint16_t sh_load_acquire_fn(volatile uint16_t *p)
+{
+    uint16_t v = *p;
+    atomic_thread_fence(memory_order_acquire);
+    return v;
+}
+#define sh_load_acquire(p)     sh_load_acquire_fn(p)
+#define sh_store_release(p, v) do { atomic_thread_fence(memory_order_release); *(p) = (v); } while (0)
+#else
+#if SHELL_SMP
+#error "SHELL_SMP needs GCC/Clang __atomic builtins or C11 <stdatomic.h>"
+#endif
+/* Single-core fallback: volatile only orders against the compiler */
+#define sh_load_acquire(p)     (*(p))
+#define sh_store_release(p, v) (*(p) = (v))
+#endif
+
+/* Producer side: only the feeding context writes the queue counters */
+static void mt_queue_depth(shell_t *sh, uint16_t depth)
+{
+#if SHELL_ENABLE_METRICS
+    if (depth > sh->metrics.in_q_high_water)
+        sh->metrics.in_q_high_water = depth;
+#else
+    (void)sh; (void)depth;
+#endif
+}
+
 bool shell_feed_char(shell_t *sh, uint8_t ch)
 {
     uint16_t head = sh->in_head;
-    uint16_t next = (uint16_t)((head + 1) & (SHELL_INPUT_QUEUE_SIZE - 1));
+    uint16_t next = (uint16_t)((head + 1) & SH_QMASK);
 
-    if (next == sh->in_tail) {
+    uint16_t tail = sh_load_acquire(&sh->in_tail);
+
+    if (next == tail) {
+        MT_ADD(sh, in_q_drops, 1);
         return false;
     }
     sh->in_q[head] = ch;
-    sh->in_head = next;
+    sh_store_release(&sh->in_head, next);
+    mt_queue_depth(sh, (uint16_t)((next - tail) & SH_QMASK));
     return true;
 }
 
+uint16_t shell_feed_buf(shell_t *sh, const uint8_t *buf, uint16_t len)
+{
+    if (!sh || !buf || len == 0) return 0;
+
+    uint16_t head = sh->in_head;
+    uint16_t tail = sh_load_acquire(&sh->in_tail);
+    uint16_t room = (uint16_t)((tail - head - 1) & SH_QMASK);
+    uint16_t n    = len < room ? len : room;
+    MT_ADD(sh, in_q_drops, len - n);
+    if (n == 0) return 0;
+
+    /* Up to two contiguous spans: [head, end) then [0, ...) */
+    uint16_t first = (uint16_t)(SHELL_INPUT_QUEUE_SIZE - head);
+    if (first > n) first = n;
+    memcpy(&sh->in_q[head], buf, first);
+    if (n > first)
+        memcpy(&sh->in_q[0], buf + first, (size_t)(n - first));
+
+    sh_store_release(&sh->in_head, (uint16_t)((head + n) & SH_QMASK));
+    mt_queue_depth(sh, (uint16_t)((head + n - tail) & SH_QMASK));
+    return n;
+}
+
 static int shell_dequeue_char(shell_t *sh)
 {
-    if (sh->in_tail == sh->in_head) {
+    uint16_t tail = sh->in_tail;
+    if (tail == sh_load_acquire(&sh->in_head)) {
         return -1;
     }
-    uint8_t ch = sh->in_q[sh->in_tail];
-    sh->in_tail = (uint16_t)((sh->in_tail + 1) & (SHELL_INPUT_QUEUE_SIZE - 1));
+    uint8_t ch = sh->in_q[tail];
+    sh_store_release(&sh->in_tail, (uint16_t)((tail + 1) & SH_QMASK));
     return ch;
 }
 
+/* ===========================
+ * Command tables
+ *
+ * A set holds one table, or (SHELL_FEATURE_SPANS) several spans that
+ * are numbered back to back. Everything past loading goes through the
+ * command id, so the trie, the hash, RPC and metrics see one table.
+ * =========================== */
+#if SHELL_FEATURE_SPANS
+#define CS_SPANS(cs) ((cs)->spans != NULL)
+
+/* The last span starting at or below id; an empty span shares its base
+ * with the next one, so it is never picked */
+static const shell_ext_cmd_t *cs_cmd(const shell_cmdset_t *cs, uint16_t id)
+{
+    if (!cs->spans)
+        return &cs->cmd_table[id];
+
+    uint8_t lo = 0, hi = cs->span_count;
+    while (hi - lo > 1) {
+        uint8_t mid = (uint8_t)((lo + hi) / 2);
+        if (cs->span_base[mid] <= id) lo = mid;
+        else                          hi = mid;
+    }
+    return &cs->spans[lo].table[id - cs->span_base[lo]];
+}
+#else
+#define CS_SPANS(cs) false
+#define cs_cmd(cs, id) (&(cs)->cmd_table[id])
+#endif
+
 /* ===========================
  * ART helpers
+ *
+ * Nodes are carved from a byte arena and addressed by 16-bit offsets.
+ * Every node starts with a common header followed by one of four bodies,
+ * picked by fan-out and grown on demand:
+ *
+ *   Node4/16  keys[cap] (sorted), children[cap]
+ *   Node48    index[256] (slot + 1, 0 = empty), children[48]
+ *   Node256   children[256] (ART_NIL = empty)
+ *
+ * Paths are compressed optimistically: a node only records its depth and
+ * how many bytes were collapsed into it, not the bytes themselves. Leaves
+ * are not nodes at all; a child slot holds ART_LEAF(cmd_idx) instead.
+ * Skipped bytes are verified against the command name (which already
+ * lives in the table), so node count scales with branch points rather
+ * than with total name length.
+ *
+ * Multi-byte fields are stored little-endian byte by byte, so the same
+ * arena bytes are valid on any target (see tools/shell_trie_gen).
+ *
+ * Reads go through cs->art, which is either the RAM arena built by
+ * shell_load_table() or a const one from shell_load_prebuilt_trie().
  * =========================== */
-static int16_t art_new_node(shell_t *sh, uint8_t key)
+#define ART_NIL        0xFFFFu  /* Also marks empty PHF slots */
+
+#if SHELL_FEATURE_ART
+#define ART_LEAF(ci)   ((uint16_t)(0x8000u | (ci)))
+#define ART_IS_LEAF(v) (((v) & 0x8000u) != 0)
+#define ART_LEAF_CMD(v) ((uint16_t)((v) & 0x7FFFu))
+
+enum { ART_NODE4 = 0, ART_NODE16, ART_NODE48, ART_NODE256 };
+
+/* Header layout */
+#define ART_H_TYPE     0
+#define ART_H_COUNT    1   /* Number of children */
+#define ART_H_CMD      2   /* u16 command ending here, ART_NIL if none */
+#define ART_H_PARENT   4   /* u16 offset, ART_NIL for the root */
+#define ART_H_NCMDS    6   /* u16 commands in this subtree */
+#define ART_H_MAXLEN   8   /* u8 longest name in this subtree */
+#define ART_H_DEPTH    9   /* u8 length of the string this node stands for */
+#define ART_H_PLEN     10  /* u8 bytes collapsed into this node */
+#define ART_HDR        11
+
+/* Size of a one-node-per-char Node4, used to report compression savings */
+#define ART_FLAT_NODE_SIZE (ART_HDR - 3 + 4 * 3)
+
+static const uint16_t art_cap[4] = { 4, 16, 48, 256 };
+
+static inline uint16_t art_rd16(const uint8_t *p)
 {
-    if (sh->art_free >= SHELL_ART_MAX_NODES) {
-        sh->art_overflow = true;
-        return -1;
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint16_t art_cmd(const shell_cmdset_t *cs, uint16_t node)
+{
+    return art_rd16(cs->art + node + ART_H_CMD);
+}
+
+static inline uint16_t art_parent(const shell_cmdset_t *cs, uint16_t node)
+{
+    return art_rd16(cs->art + node + ART_H_PARENT);
+}
+
+/* Find c among the first n keys. Four keys are tested per step with a
+ * SWAR zero-byte check; only a group that reports a hit is scanned. */
+static int art_find_key16(const uint8_t *keys, uint8_t n, uint8_t c)
+{
+    const uint32_t pattern = 0x01010101u * c;
+    for (uint8_t g = 0; g < n; g = (uint8_t)(g + 4)) {
+        uint32_t w;
+        memcpy(&w, keys + g, sizeof w);
+        w ^= pattern;
+        if ((w - 0x01010101u) & ~w & 0x80808080u) {
+            for (uint8_t i = g; i < n && i < g + 4; i++) {
+                if (keys[i] == c)
+                    return i;
+            }
+        }
+    }
+    return -1;
+}
+
+static uint16_t art_find_child(const shell_cmdset_t *cs, uint16_t node, uint8_t c)
+{
+    const uint8_t *n = cs->art + node;
+    const uint8_t *b = n + ART_HDR;
+    uint8_t count = n[ART_H_COUNT];
+    int i;
+
+    switch (n[ART_H_TYPE]) {
+    case ART_NODE4:
+        for (i = 0; i < count; i++) {
+            if (b[i] == c)
+                return art_rd16(b + 4 + 2 * i);
+        }
+        return ART_NIL;
+    case ART_NODE16:
+        i = art_find_key16(b, count, c);
+        return i < 0 ? ART_NIL : art_rd16(b + 16 + 2 * i);
+    case ART_NODE48:
+        i = b[c];
+        return i ? art_rd16(b + 256 + 2 * (i - 1)) : ART_NIL;
+    default:
+        return art_rd16(b + 2 * c);
+    }
+}
+
+/* Iterate children in key order. Start with *pos = 0; returns ART_NIL
+ * when there are no more. */
+static uint16_t art_child_next(const shell_cmdset_t *cs, uint16_t node, uint16_t *pos, uint8_t *key)
+{
+    const uint8_t *n = cs->art + node;
+    const uint8_t *b = n + ART_HDR;
+    uint8_t type = n[ART_H_TYPE];
+
+    if (type == ART_NODE4 || type == ART_NODE16) {
+        if (*pos >= n[ART_H_COUNT])
+            return ART_NIL;
+        *key = b[*pos];
+        uint16_t child = art_rd16(b + art_cap[type] + 2 * *pos);
+        (*pos)++;
+        return child;
     }
-    int16_t idx = (int16_t)sh->art_free++;
-    if (sh->art_free > sh->art_max_used)
-        sh->art_max_used = sh->art_free;
 
-    shell_art_node_t *n = &sh->art_nodes[idx];
-    n->n_children = 0;
-    n->key        = key;
-    n->cmd_idx    = -1;
-    for (int i = 0; i < SHELL_ART_MAX_CHILDREN; i++) {
-        n->child_idx[i] = -1;
-        n->child_key[i] = 0;
+    for (; *pos < 256; (*pos)++) {
+        uint16_t child;
+        if (type == ART_NODE48)
+            child = b[*pos] ? art_rd16(b + 256 + 2 * (b[*pos] - 1)) : ART_NIL;
+        else
+            child = art_rd16(b + 2 * *pos);
+        if (child != ART_NIL) {
+            *key = (uint8_t)*pos;
+            (*pos)++;
+            return child;
+        }
     }
-    return idx;
+    return ART_NIL;
 }
 
-static int16_t art_find_child(shell_t *sh, int16_t node_idx, uint8_t c)
+/* Any command below a child slot; its name spells out the skipped bytes */
+static uint16_t art_rep_cmd(const shell_cmdset_t *cs, uint16_t ref)
 {
-    shell_art_node_t *n = &sh->art_nodes[node_idx];
-    for (uint8_t i = 0; i < n->n_children; i++) {
-        if (n->child_key[i] == c)
-            return n->child_idx[i];
+    while (!ART_IS_LEAF(ref)) {
+        uint16_t ci = art_cmd(cs, ref);
+        if (ci != ART_NIL)
+            return ci;
+        uint16_t pos = 0;
+        uint8_t key;
+        ref = art_child_next(cs, ref, &pos, &key);
     }
-    return -1;
+    return ART_LEAF_CMD(ref);
 }
 
-static int16_t art_add_child(shell_t *sh, int16_t node_idx, uint8_t c)
+static inline const char *art_cmd_name(const shell_cmdset_t *cs, uint16_t ci)
 {
-    shell_art_node_t *n = &sh->art_nodes[node_idx];
-    if (n->n_children >= SHELL_ART_MAX_CHILDREN)
-        return -1;
-    int16_t new_idx = art_new_node(sh, c);
-    if (new_idx < 0)
-        return -1;
-    n->child_key[n->n_children] = c;
-    n->child_idx[n->n_children] = new_idx;
-    n->n_children++;
-    return new_idx;
+    return cs_cmd(cs, ci)->name;
 }
 
-static bool art_insert(shell_t *sh, const char *name, int16_t cmd_idx)
+#if SHELL_ART_ARENA_SIZE > 0
+typedef char sh_art_arena_fits[(SHELL_ART_ARENA_SIZE <= 0x7FFF) ? 1 : -1];
+
+static const uint16_t art_size[4] = {
+    ART_HDR + 4 * 3,
+    ART_HDR + 16 * 3,
+    ART_HDR + 256 + 48 * 2,
+    ART_HDR + 256 * 2,
+};
+
+static inline void art_wr16(uint8_t *p, uint16_t v)
 {
-    int16_t cur = sh->art_root;
-    const unsigned char *p = (const unsigned char*)name;
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
 
-    while (*p) {
-        int16_t child = art_find_child(sh, cur, *p);
-        if (child < 0) {
-            child = art_add_child(sh, cur, *p);
-            if (child < 0) return false;
+static uint16_t art_alloc(shell_cmdset_t *cs, uint8_t type)
+{
+    uint16_t off = cs->art_free_list[type];
+    if (off != ART_NIL) {
+        /* Freed nodes chain through their cmd field */
+        cs->art_free_list[type] = art_rd16(cs->art_arena + off + ART_H_CMD);
+    } else {
+        if (SHELL_ART_ARENA_SIZE - cs->art_used < art_size[type]) {
+            cs->art_overflow = true;
+            return ART_NIL;
         }
-        cur = child;
-        p++;
+        off = cs->art_used;
+        cs->art_used = (uint16_t)(cs->art_used + art_size[type]);
     }
 
-    sh->art_nodes[cur].cmd_idx = cmd_idx;
-    return true;
+    uint8_t *n = cs->art_arena + off;
+    memset(n, 0, art_size[type]);
+    if (type == ART_NODE256)
+        memset(n + ART_HDR, 0xFF, 256 * 2);
+    n[ART_H_TYPE] = type;
+    art_wr16(n + ART_H_CMD, ART_NIL);
+    art_wr16(n + ART_H_PARENT, ART_NIL);
+    cs->art_max_used++;
+    return off;
 }
 
-static const shell_ext_cmd_t *art_lookup(shell_t *sh, const char *name)
+static void art_release(shell_cmdset_t *cs, uint16_t off)
 {
-    if (!sh->cmd_table) return NULL;
-    int16_t cur = sh->art_root;
-    const unsigned char *p = (const unsigned char*)name;
+    uint8_t type = cs->art_arena[off + ART_H_TYPE];
+    art_wr16(cs->art_arena + off + ART_H_CMD, cs->art_free_list[type]);
+    cs->art_free_list[type] = off;
+    cs->art_max_used--;
+}
 
-    while (*p) {
-        int16_t child = art_find_child(sh, cur, *p);
-        if (child < 0)
-            return NULL;
-        cur = child;
-        p++;
+static void art_reset(shell_cmdset_t *cs)
+{
+    for (int i = 0; i < 4; i++)
+        cs->art_free_list[i] = ART_NIL;
+    cs->art          = cs->art_arena;
+    cs->art_used     = 0;
+    cs->art_max_used = 0;
+    cs->art_overflow = false;
+    cs->art_flat_nodes = 1;
+    cs->art_root     = art_alloc(cs, ART_NODE4);
+}
+
+/* Add a new key to a node that has room for it */
+static void art_put_child(uint8_t *n, uint8_t key, uint16_t child)
+{
+    uint8_t *b = n + ART_HDR;
+    uint8_t count = n[ART_H_COUNT];
+
+    switch (n[ART_H_TYPE]) {
+    case ART_NODE4:
+    case ART_NODE16: {
+        uint16_t cap = art_cap[n[ART_H_TYPE]];
+        uint8_t i = count;
+        /* Keep keys sorted so completion lists come out in order */
+        while (i > 0 && b[i - 1] > key) {
+            b[i] = b[i - 1];
+            memcpy(b + cap + 2 * i, b + cap + 2 * (i - 1), 2);
+            i--;
+        }
+        b[i] = key;
+        art_wr16(b + cap + 2 * i, child);
+        break;
+    }
+    case ART_NODE48:
+        /* No deletions, so slots fill up in order */
+        b[key] = (uint8_t)(count + 1);
+        art_wr16(b + 256 + 2 * count, child);
+        break;
+    default:
+        art_wr16(b + 2 * key, child);
+        break;
     }
+    n[ART_H_COUNT] = (uint8_t)(count + 1);
+}
 
-    int16_t ci = sh->art_nodes[cur].cmd_idx;
-    if (ci >= 0 && ci < sh->cmd_count)
-        return &sh->cmd_table[ci];
-    return NULL;
+static void art_replace_child(uint8_t *n, uint16_t from, uint16_t to)
+{
+    uint8_t type = n[ART_H_TYPE];
+    uint8_t *c = n + ART_HDR;
+    uint16_t slots = n[ART_H_COUNT];
+
+    if (type == ART_NODE48) {
+        c += 256;
+    } else if (type == ART_NODE256) {
+        slots = 256;
+    } else {
+        c += art_cap[type];
+    }
+    for (uint16_t i = 0; i < slots; i++) {
+        if (art_rd16(c + 2 * i) == from) {
+            art_wr16(c + 2 * i, to);
+            return;
+        }
+    }
 }
 
-/* ===========================
- * Arg parsing (with quote support)
- * =========================== */
-static int build_argv(char *line, char **argv, int max_args)
+/* Move a full node into the next larger class */
+static uint16_t art_grow(shell_cmdset_t *cs, uint16_t node)
 {
-    int argc = 0;
-    char *p = line;
-    enum { STATE_WHITESPACE, STATE_TOKEN, STATE_QUOTE } state = STATE_WHITESPACE;
+    uint16_t big = art_alloc(cs, (uint8_t)(cs->art_arena[node + ART_H_TYPE] + 1));
+    if (big == ART_NIL)
+        return ART_NIL;
 
-    while (*p && argc < max_args) {
-        switch (state) {
-        case STATE_WHITESPACE:
-            while (*p && isspace((unsigned char)*p)) {
-                p++;
-            }
-            if (!*p) {
-                break; // End of line
-            }
-            if (*p == '"') {
-                argv[argc++] = p + 1; // Start token *after* quote
-                state = STATE_QUOTE;
-                p++;
-            } else {
-                argv[argc++] = p;
-                state = STATE_TOKEN;
-            }
-            break;
+    uint8_t *g = cs->art_arena + big;
+    memcpy(g + ART_H_CMD, cs->art_arena + node + ART_H_CMD, ART_HDR - ART_H_CMD);
 
-        case STATE_TOKEN:
-            if (isspace((unsigned char)*p)) {
-                *p = '\0';
-                state = STATE_WHITESPACE;
+    uint16_t pos = 0, child;
+    uint8_t key;
+    while ((child = art_child_next(cs, node, &pos, &key)) != ART_NIL) {
+        art_put_child(g, key, child);
+        if (!ART_IS_LEAF(child))
+            art_wr16(cs->art_arena + child + ART_H_PARENT, big);
+    }
+
+    uint16_t parent = art_parent(cs, node);
+    if (parent == ART_NIL)
+        cs->art_root = big;
+    else
+        art_replace_child(cs->art_arena + parent, node, big);
+
+    art_release(cs, node);
+    return big;
+}
+
+/* Add child under key c, growing the node first if it is full.
+ * Returns the node's (possibly new) offset, or ART_NIL. */
+static uint16_t art_add_child(shell_cmdset_t *cs, uint16_t node, uint8_t c, uint16_t child)
+{
+    uint8_t *n = cs->art_arena + node;
+    if (n[ART_H_COUNT] >= art_cap[n[ART_H_TYPE]]) {
+        node = art_grow(cs, node);
+        if (node == ART_NIL)
+            return ART_NIL;
+    }
+    if (!ART_IS_LEAF(child))
+        art_wr16(cs->art_arena + child + ART_H_PARENT, node);
+    art_put_child(cs->art_arena + node, c, child);
+    return node;
+}
+
+/* New inner node at the given depth, collapsing plen bytes above it */
+static uint16_t art_new_inner(shell_cmdset_t *cs, size_t depth, size_t plen)
+{
+    uint16_t n = art_alloc(cs, ART_NODE4);
+    if (n == ART_NIL)
+        return ART_NIL;
+    cs->art_arena[n + ART_H_DEPTH] = (uint8_t)depth;
+    cs->art_arena[n + ART_H_PLEN]  = (uint8_t)plen;
+    return n;
+}
+
+/* Account for a new command of length len on the path from node up */
+static void art_count_up(shell_cmdset_t *cs, uint16_t node, size_t len)
+{
+    for (uint16_t a = node; a != ART_NIL; a = art_parent(cs, a)) {
+        uint8_t *an = cs->art_arena + a;
+        art_wr16(an + ART_H_NCMDS, (uint16_t)(art_rd16(an + ART_H_NCMDS) + 1));
+        if (len > an[ART_H_MAXLEN])
+            an[ART_H_MAXLEN] = (uint8_t)len;
+    }
+}
+
+static bool art_insert(shell_cmdset_t *cs, const char *name, uint16_t cmd_idx)
+{
+    const uint8_t *s = (const uint8_t *)name;
+    size_t len = strlen(name);
+    uint16_t cur = cs->art_root;
+
+    if (len > 0xFF)
+        return false;
+
+    for (;;) {
+        uint8_t *n  = cs->art_arena + cur;
+        size_t depth = n[ART_H_DEPTH];
+        size_t start = depth - n[ART_H_PLEN];
+
+        /* Verify the collapsed bytes; split the node where they differ */
+        if (start < depth) {
+            const uint8_t *rep = (const uint8_t *)art_cmd_name(cs, art_rep_cmd(cs, cur));
+            size_t i = start;
+            while (i < depth && i < len && s[i] == rep[i])
+                i++;
+            if (i < depth) {
+                uint16_t parent = art_parent(cs, cur);
+                uint16_t split = art_new_inner(cs, i, i - start);
+                if (split == ART_NIL)
+                    return false;
+                uint8_t *sp = cs->art_arena + split;
+                n = cs->art_arena + cur;
+                memcpy(sp + ART_H_NCMDS, n + ART_H_NCMDS, 3); /* ncmds, maxlen */
+                art_wr16(sp + ART_H_PARENT, parent);
+                art_replace_child(cs->art_arena + parent, cur, split);
+                n[ART_H_PLEN] = (uint8_t)(depth - i - 1);
+                art_add_child(cs, split, rep[i], cur);
+                if (i == len) {
+                    art_wr16(sp + ART_H_CMD, cmd_idx);
+                } else {
+                    art_add_child(cs, split, s[i], ART_LEAF(cmd_idx));
+                }
+                art_count_up(cs, split, len);
+                cs->art_flat_nodes += (uint32_t)(len - i);
+                return true;
             }
-            p++;
-            break;
+        }
 
-        case STATE_QUOTE:
+        if (depth == len) {
+            if (art_rd16(n + ART_H_CMD) == ART_NIL)
+                art_count_up(cs, cur, len);
+            art_wr16(n + ART_H_CMD, cmd_idx);
+            return true;
+        }
+
+        uint16_t child = art_find_child(cs, cur, s[depth]);
+        if (child == ART_NIL) {
+            cur = art_add_child(cs, cur, s[depth], ART_LEAF(cmd_idx));
+            if (cur == ART_NIL)
+                return false;
+            art_count_up(cs, cur, len);
+            cs->art_flat_nodes += (uint32_t)(len - depth);
+            return true;
+        }
+
+        if (ART_IS_LEAF(child)) {
+            /* Expand the leaf into a node where the two names diverge */
+            uint16_t other = ART_LEAF_CMD(child);
+            const uint8_t *o = (const uint8_t *)art_cmd_name(cs, other);
+            size_t olen = strlen((const char *)o);
+            size_t i = depth + 1;
+            while (i < len && i < olen && s[i] == o[i])
+                i++;
+            if (i == len && i == olen) {
+                /* Duplicate name: the later entry wins */
+                art_replace_child(cs->art_arena + cur, child, ART_LEAF(cmd_idx));
+                return true;
+            }
+
+            uint16_t inner = art_new_inner(cs, i, i - depth - 1);
+            if (inner == ART_NIL)
+                return false;
+            if (i == olen)
+                art_wr16(cs->art_arena + inner + ART_H_CMD, other);
+            else
+                art_add_child(cs, inner, o[i], child);
+            if (i == len)
+                art_wr16(cs->art_arena + inner + ART_H_CMD, cmd_idx);
+            else
+                art_add_child(cs, inner, s[i], ART_LEAF(cmd_idx));
+
+            uint8_t *in = cs->art_arena + inner;
+            art_wr16(in + ART_H_NCMDS, 1);
+            in[ART_H_MAXLEN] = (uint8_t)olen;
+            art_wr16(in + ART_H_PARENT, cur);
+            art_replace_child(cs->art_arena + cur, child, inner);
+            art_count_up(cs, inner, len);
+            cs->art_flat_nodes += (uint32_t)(len - i);
+            return true;
+        }
+
+        cur = child;
+    }
+}
+#endif
+
+#if SHELL_FEATURE_COMPLETION || SHELL_FEATURE_ABBREV
+/* Find the slot (node or leaf) covering the first len chars of s, so
+ * every command below it starts with them. ART_NIL if there is none. */
+static uint16_t art_walk(const shell_cmdset_t *cs, const char *s, size_t len)
+{
+    uint16_t cur = cs->art_root;
+    while (!ART_IS_LEAF(cur) && cs->art[cur + ART_H_DEPTH] < len) {
+        cur = art_find_child(cs, cur, (uint8_t)s[cs->art[cur + ART_H_DEPTH]]);
+        if (cur == ART_NIL)
+            return ART_NIL;
+    }
+
+    /* Collapsed bytes were skipped; check them against a real name */
+    if (len > 0 && strncmp(art_cmd_name(cs, art_rep_cmd(cs, cur)), s, len) != 0)
+        return ART_NIL;
+    return cur;
+}
+#endif
+
+#if SHELL_FEATURE_COMPLETION
+/* Pre-order iteration over the commands strictly below a node */
+typedef struct {
+    uint16_t top;
+    uint16_t node;
+    uint16_t pos;
+} art_iter_t;
+
+static void art_iter_init(art_iter_t *it, uint16_t top)
+{
+    it->top  = top;
+    it->node = top;
+    it->pos  = 0;
+}
+
+static uint16_t art_iter_next(const shell_cmdset_t *cs, art_iter_t *it)
+{
+    for (;;) {
+        uint8_t key;
+        uint16_t child = art_child_next(cs, it->node, &it->pos, &key);
+        if (child != ART_NIL) {
+            if (ART_IS_LEAF(child))
+                return ART_LEAF_CMD(child);
+            it->node = child;
+            it->pos  = 0;
+            if (art_cmd(cs, child) != ART_NIL)
+                return art_cmd(cs, child);
+            continue;
+        }
+
+        if (it->node == it->top)
+            return ART_NIL;
+
+        /* Climb and resume after the node we just finished */
+        uint16_t done = it->node;
+        it->node = art_parent(cs, done);
+        it->pos  = 0;
+        while (art_child_next(cs, it->node, &it->pos, &key) != done)
+            ;
+    }
+}
+#endif /* SHELL_FEATURE_COMPLETION */
+
+static const shell_ext_cmd_t *art_lookup(const shell_cmdset_t *cs, const char *name)
+{
+    if (!cs->cmd_table || !cs->art) return NULL;
+    size_t len = strlen(name);
+    uint16_t cur = cs->art_root;
+
+    while (!ART_IS_LEAF(cur) && cs->art[cur + ART_H_DEPTH] < len) {
+        cur = art_find_child(cs, cur, (uint8_t)name[cs->art[cur + ART_H_DEPTH]]);
+        if (cur == ART_NIL)
+            return NULL;
+    }
+
+    uint16_t ci;
+    if (ART_IS_LEAF(cur))
+        ci = ART_LEAF_CMD(cur);
+    else if (cs->art[cur + ART_H_DEPTH] == len)
+        ci = art_cmd(cs, cur);
+    else
+        return NULL;
+
+    if (ci >= cs->cmd_count)
+        return NULL;
+    /* One strcmp verifies everything the walk skipped */
+    const shell_ext_cmd_t *cmd = cs_cmd(cs, ci);
+    return strcmp(cmd->name, name) == 0 ? cmd : NULL;
+}
+#endif /* SHELL_FEATURE_ART */
+
+/* ===========================
+ * Table lookup
+ *
+ * Used without the trie: when it is compiled out, when the table was
+ * loaded sorted, or when the trie overflowed. A table in strcmp order
+ * is binary searched, anything else costs one strcmp per entry.
+ * =========================== */
+static bool tbl_is_sorted(const shell_ext_cmd_t *table, uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++) {
+        if (!table[i].name)
+            return false;
+        if (i && strcmp(table[i - 1].name, table[i].name) >= 0)
+            return false;
+    }
+    return true;
+}
+
+/* Every table of the set is sorted, each on its own */
+static bool cs_is_sorted(const shell_cmdset_t *cs)
+{
+#if SHELL_FEATURE_SPANS
+    if (cs->spans) {
+        for (uint8_t i = 0; i < cs->span_count; i++) {
+            if (!tbl_is_sorted(cs->spans[i].table, cs->spans[i].count))
+                return false;
+        }
+        return true;
+    }
+#endif
+    return tbl_is_sorted(cs->cmd_table, cs->cmd_count);
+}
+
+static const shell_ext_cmd_t *tbl_bsearch(const shell_ext_cmd_t *table, uint16_t count,
+                                          const char *name)
+{
+    uint16_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        uint16_t mid = (uint16_t)(lo + (hi - lo) / 2);
+        int c = strcmp(table[mid].name, name);
+        if (c == 0)
+            return &table[mid];
+        if (c < 0) lo = (uint16_t)(mid + 1);
+        else       hi = mid;
+    }
+    return NULL;
+}
+
+static const shell_ext_cmd_t *tbl_lookup(const shell_cmdset_t *cs, const char *name)
+{
+    if (!cs->cmd_table) return NULL;
+    if (cs->sorted) {
+#if SHELL_FEATURE_SPANS
+        if (cs->spans) {
+            /* Last span first, so a later span shadows an earlier one */
+            for (uint8_t i = cs->span_count; i-- > 0; ) {
+                const shell_ext_cmd_t *cmd =
+                    tbl_bsearch(cs->spans[i].table, cs->spans[i].count, name);
+                if (cmd)
+                    return cmd;
+            }
+            return NULL;
+        }
+#endif
+        return tbl_bsearch(cs->cmd_table, cs->cmd_count, name);
+    }
+    /* From the end: of two equal names the later wins, as in the trie */
+    for (uint16_t i = cs->cmd_count; i-- > 0; ) {
+        const shell_ext_cmd_t *cmd = cs_cmd(cs, i);
+        if (cmd->name && strcmp(cmd->name, name) == 0)
+            return cmd;
+    }
+    return NULL;
+}
+
+#if SHELL_FEATURE_COMPLETION || SHELL_FEATURE_ABBREV
+/* Entries [*lo, *hi) that can start with s */
+static void tbl_range(const shell_cmdset_t *cs, const char *s, size_t len,
+                      uint16_t *lo, uint16_t *hi)
+{
+    *lo = 0;
+    *hi = cs->cmd_count;
+    if (!cs->sorted || CS_SPANS(cs))
+        return; /* Spans are only sorted each on its own */
+
+    uint16_t a = 0, b = cs->cmd_count;
+    while (a < b) { /* First name not below the prefix */
+        uint16_t mid = (uint16_t)(a + (b - a) / 2);
+        if (strncmp(cs_cmd(cs, mid)->name, s, len) < 0) a = (uint16_t)(mid + 1);
+        else                                              b = mid;
+    }
+    *lo = a;
+    b = cs->cmd_count;
+    while (a < b) { /* First name past it */
+        uint16_t mid = (uint16_t)(a + (b - a) / 2);
+        if (strncmp(cs_cmd(cs, mid)->name, s, len) <= 0) a = (uint16_t)(mid + 1);
+        else                                               b = mid;
+    }
+    *hi = a;
+}
+#endif
+
+#if SHELL_DISPATCH_PHF
+/* ===========================
+ * Perfect-hash dispatch
+ *
+ * Hash-and-displace: names are spread over n/4 buckets, and each bucket
+ * gets a 16-bit displacement that moves all of its names onto free
+ * slots of an n-slot table. Buckets are placed largest first. Lookup
+ * is two hash mixes, one table read and a single verifying strcmp.
+ * =========================== */
+#define PHF_BUCKET_LOAD 4
+#define PHF_BUCKETS(n)  (((n) + PHF_BUCKET_LOAD - 1) / PHF_BUCKET_LOAD)
+#define PHF_MAX_BUCKET  16 /* Larger buckets are retried with a new salt */
+#define PHF_MAX_SALT   8
+
+static uint32_t phf_hash(const char *s, uint8_t salt)
+{
+    uint32_t h = 2166136261u ^ (salt * 0x9E3779B9u);
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint16_t phf_slot(uint32_t h, uint16_t disp, uint16_t n)
+{
+    h ^= disp * 0x9E3779B9u;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return (uint16_t)(h % n);
+}
+
+/* Place the names of one bucket; the later of two equal names wins */
+static bool phf_place(shell_cmdset_t *cs, uint16_t bucket, uint16_t r)
+{
+    uint16_t keys[PHF_MAX_BUCKET];
+    uint32_t hash[PHF_MAX_BUCKET];
+    uint16_t slots[PHF_MAX_BUCKET];
+    uint8_t  k = 0;
+    uint16_t n = cs->cmd_count;
+
+    for (uint16_t i = 0; i < n; i++) {
+        const char *name = cs_cmd(cs, i)->name;
+        if (!name) continue;
+        uint32_t h = phf_hash(name, cs->phf_salt);
+        if (h % r != bucket) continue;
+
+        uint8_t j = 0;
+        while (j < k && strcmp(cs_cmd(cs, keys[j])->name, name) != 0)
+            j++;
+        keys[j] = i;
+        hash[j] = h;
+        if (j == k) k++;
+    }
+
+    for (uint32_t d = 0; d <= 0xFFFF; d++) {
+        uint8_t j;
+        for (j = 0; j < k; j++) {
+            slots[j] = phf_slot(hash[j], (uint16_t)d, n);
+            if (cs->phf_map[slots[j]] != ART_NIL)
+                break;
+            uint8_t m = 0;
+            while (m < j && slots[m] != slots[j])
+                m++;
+            if (m < j)
+                break;
+        }
+        if (j == k) {
+            for (j = 0; j < k; j++)
+                cs->phf_map[slots[j]] = keys[j];
+            cs->phf_disp[bucket] = (uint16_t)d;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool phf_try(shell_cmdset_t *cs)
+{
+    uint16_t n = cs->cmd_count;
+    uint16_t r = (uint16_t)PHF_BUCKETS(n);
+    uint8_t  placed[PHF_BUCKETS(SHELL_PHF_MAX_CMDS) / 8 + 1];
+
+    /* Bucket sizes first, kept in phf_disp until each bucket is placed */
+    memset(cs->phf_disp, 0, r * sizeof cs->phf_disp[0]);
+    memset(placed, 0, sizeof placed);
+    for (uint16_t i = 0; i < n; i++) {
+        const char *name = cs_cmd(cs, i)->name;
+        if (!name) continue;
+        uint16_t b = (uint16_t)(phf_hash(name, cs->phf_salt) % r);
+        if (++cs->phf_disp[b] > PHF_MAX_BUCKET)
+            return false;
+    }
+    for (uint16_t i = 0; i < n; i++)
+        cs->phf_map[i] = ART_NIL;
+
+    for (uint8_t size = PHF_MAX_BUCKET; size > 0; size--) {
+        for (uint16_t b = 0; b < r; b++) {
+            if ((placed[b / 8] & (1u << (b % 8))) || cs->phf_disp[b] != size)
+                continue;
+            if (!phf_place(cs, b, r))
+                return false;
+            placed[b / 8] |= (uint8_t)(1u << (b % 8));
+        }
+    }
+
+    /* Empty buckets are never looked up successfully; any value will do */
+    for (uint16_t b = 0; b < r; b++) {
+        if (!(placed[b / 8] & (1u << (b % 8))))
+            cs->phf_disp[b] = 0;
+    }
+    cs->phf_buckets = r;
+    return true;
+}
+
+static void phf_build(shell_cmdset_t *cs)
+{
+    cs->phf_buckets = 0;
+    if (cs->cmd_count == 0 || cs->cmd_count > SHELL_PHF_MAX_CMDS)
+        return;
+    for (cs->phf_salt = 0; cs->phf_salt < PHF_MAX_SALT; cs->phf_salt++) {
+        if (phf_try(cs))
+            return;
+    }
+    cs->phf_buckets = 0; /* Give up; the trie still resolves everything */
+}
+
+static const shell_ext_cmd_t *phf_lookup(const shell_cmdset_t *cs, const char *name)
+{
+    uint32_t h = phf_hash(name, cs->phf_salt);
+    uint16_t d = cs->phf_disp[h % cs->phf_buckets];
+    uint16_t ci = cs->phf_map[phf_slot(h, d, cs->cmd_count)];
+
+    if (ci == ART_NIL)
+        return NULL;
+    const shell_ext_cmd_t *cmd = cs_cmd(cs, ci);
+    return strcmp(cmd->name, name) == 0 ? cmd : NULL;
+}
+#endif
+
+/* Resolve a name in cs with whichever dispatch backend is active */
+static const shell_ext_cmd_t *cs_find_cmd(const shell_cmdset_t *cs, const char *name)
+{
+    if (!cs) return NULL;
+#if SHELL_DISPATCH_PHF
+    if (cs->phf_buckets)
+        return phf_lookup(cs, name);
+#endif
+#if SHELL_FEATURE_ART
+    if (cs->art)
+        return art_lookup(cs, name);
+#endif
+    return tbl_lookup(cs, name);
+}
+
+#if SHELL_FEATURE_ABBREV
+/* ===========================
+ * Abbreviations and suggestions
+ *
+ * Every trie node already counts the commands below it, so a prefix
+ * names one command exactly when the node it walks to counts one; its
+ * representative is that command. Without a trie the same question is
+ * a range of a sorted table, or one pass over an unsorted one.
+ *
+ * "Did you mean" is a bounded edit distance (Levenshtein plus swapped
+ * neighbours) computed one DP row per candidate char. Names sharing a
+ * prefix share its rows, so the trie is walked depth first and a
+ * subtree is dropped as soon as its row cannot beat the best so far.
+ * =========================== */
+#define SUG_ROWS (SHELL_SUGGEST_MAX_LEN + SHELL_SUGGEST_MAX_DIST + 1)
+
+typedef uint8_t sug_row_t[SHELL_SUGGEST_MAX_LEN + 1];
+
+/* The command the len chars at s start, or NULL; *count gets how many
+ * commands they start */
+static const shell_ext_cmd_t *cs_find_prefix(const shell_cmdset_t *cs, const char *s,
+                                             size_t len, uint16_t *count)
+{
+    *count = 0;
+    if (!cs->cmd_table || len == 0)
+        return NULL;
+#if SHELL_FEATURE_ART
+    if (cs->art) {
+        uint16_t top = art_walk(cs, s, len);
+        if (top == ART_NIL)
+            return NULL;
+        *count = ART_IS_LEAF(top) ? 1 : art_rd16(cs->art + top + ART_H_NCMDS);
+        return *count == 1 ? cs_cmd(cs, art_rep_cmd(cs, top)) : NULL;
+    }
+#endif
+    const shell_ext_cmd_t *hit = NULL;
+    uint16_t lo, hi;
+    tbl_range(cs, s, len, &lo, &hi);
+    for (uint16_t i = lo; i < hi; i++) {
+        const char *name = cs_cmd(cs, i)->name;
+        if (name && strncmp(name, s, len) == 0) {
+            hit = cs_cmd(cs, i);
+            (*count)++;
+        }
+    }
+    return *count == 1 ? hit : NULL;
+}
+
+/* Row k: the word w (n chars) against a candidate whose k-th char is
+ * c, after pc. Returns the row minimum, which no longer candidate with
+ * the same start can go below. */
+static uint8_t sug_row(sug_row_t *rows, size_t k, const char *w, size_t n,
+                       char c, char pc)
+{
+    uint8_t *r = rows[k];
+    const uint8_t *up = rows[k - 1];
+    uint8_t lo;
+
+    r[0] = lo = (uint8_t)k;
+    for (size_t j = 1; j <= n; j++) {
+        uint8_t v = (uint8_t)(up[j - 1] + (w[j - 1] != c));
+        if (up[j] + 1 < v)    v = (uint8_t)(up[j] + 1);
+        if (r[j - 1] + 1 < v) v = (uint8_t)(r[j - 1] + 1);
+        if (k > 1 && j > 1 && w[j - 1] == pc && w[j - 2] == c &&
+            rows[k - 2][j - 2] + 1 < v)
+            v = (uint8_t)(rows[k - 2][j - 2] + 1);
+        r[j] = v;
+        if (v < lo) lo = v;
+    }
+    return lo;
+}
+
+/* Extend rows over name[from, to). False once best is out of reach. */
+static bool sug_extend(sug_row_t *rows, const char *w, size_t n,
+                       const char *name, size_t from, size_t to, uint8_t best)
+{
+    for (size_t k = from; k < to; k++) {
+        if (k + 1 >= n + best) /* Too long to get under best */
+            return false;
+        if (sug_row(rows, k + 1, w, n, name[k], k ? name[k - 1] : '\0') >= best)
+            return false;
+    }
+    return true;
+}
+
+#if SHELL_FEATURE_ART
+static uint16_t art_suggest(const shell_cmdset_t *cs, const char *w, size_t n,
+                            sug_row_t *rows, uint8_t best)
+{
+    uint16_t hit = ART_NIL;
+    uint16_t node = cs->art_root, pos = 0;
+
+    for (;;) {
+        uint8_t key;
+        uint16_t child = art_child_next(cs, node, &pos, &key);
+        if (child == ART_NIL) {
+            if (node == cs->art_root)
+                return hit;
+            uint16_t done = node; /* Climb as art_iter_next() does */
+            node = art_parent(cs, done);
+            pos  = 0;
+            while (art_child_next(cs, node, &pos, &key) != done)
+                ;
+            continue;
+        }
+
+        uint16_t ci = art_rep_cmd(cs, child);
+        const char *name = art_cmd_name(cs, ci);
+        size_t to = ART_IS_LEAF(child) ? strlen(name) : cs->art[child + ART_H_DEPTH];
+        if (!sug_extend(rows, w, n, name, cs->art[node + ART_H_DEPTH], to, best))
+            continue; /* Prune the whole subtree */
+        if ((ART_IS_LEAF(child) || art_cmd(cs, child) != ART_NIL) && rows[to][n] < best) {
+            best = rows[to][n];
+            hit  = ci;
+        }
+        if (!ART_IS_LEAF(child)) {
+            node = child;
+            pos  = 0;
+        }
+    }
+}
+#endif
+
+/* The closest name to w within the edit budget, or NULL */
+static const char *cs_suggest(const shell_cmdset_t *cs, const char *w)
+{
+    sug_row_t rows[SUG_ROWS];
+    size_t n = strlen(w);
+
+    if (!cs || !cs->cmd_table || n < 2 || n > SHELL_SUGGEST_MAX_LEN)
+        return NULL;
+    uint8_t best = (uint8_t)(n / 3 < 1 ? 1 : n / 3); /* Fewer edits for short words */
+    if (best > SHELL_SUGGEST_MAX_DIST) best = SHELL_SUGGEST_MAX_DIST;
+    best++; /* Anything under this is worth offering */
+    for (size_t j = 0; j <= n; j++)
+        rows[0][j] = (uint8_t)j;
+
+#if SHELL_FEATURE_ART
+    if (cs->art) {
+        uint16_t ci = art_suggest(cs, w, n, rows, best);
+        return ci == ART_NIL ? NULL : art_cmd_name(cs, ci);
+    }
+#endif
+    const char *hit = NULL;
+    for (uint16_t i = 0; i < cs->cmd_count; i++) {
+        const char *name = cs_cmd(cs, i)->name;
+        size_t len = name ? strlen(name) : 0;
+        if (name && sug_extend(rows, w, n, name, 0, len, best) && rows[len][n] < best) {
+            best = rows[len][n];
+            hit  = name;
+        }
+    }
+    return hit;
+}
+
+/* After a miss: why a prefix didn't run, or the nearest real name */
+static void sh_suggest(shell_t *sh, const shell_cmdset_t *cs, const char *w)
+{
+    uint16_t count;
+    if (!cs) return;
+    if (sh->abbrev) {
+        cs_find_prefix(cs, w, strlen(w), &count);
+        if (count > 1) {
+            sh_puts(sh, "Ambiguous: ");
+            sh_puts(sh, w);
+            sh_puts(sh, " (");
+            sh_puts_uint(sh, count);
+            sh_puts(sh, " commands)\r\n");
+            return;
+        }
+    }
+    const char *guess = cs_suggest(cs, w);
+    if (guess) {
+        sh_puts(sh, "Did you mean '");
+        sh_puts(sh, guess);
+        sh_puts(sh, "'?\r\n");
+    }
+}
+#else
+#define sh_suggest(sh, cs, w) ((void)0)
+#endif /* SHELL_FEATURE_ABBREV */
+
+/* Exact name first; with abbreviations on, a prefix of only one */
+static const shell_ext_cmd_t *sh_resolve(const shell_t *sh, const shell_cmdset_t *cs,
+                                         const char *name)
+{
+    const shell_ext_cmd_t *cmd = cs_find_cmd(cs, name);
+#if SHELL_FEATURE_ABBREV
+    uint16_t count;
+    if (!cmd && cs && sh->abbrev)
+        cmd = cs_find_prefix(cs, name, strlen(name), &count);
+#else
+    (void)sh;
+#endif
+    return cmd;
+}
+
+static const shell_ext_cmd_t *sh_find_cmd(shell_t *sh, const char *name)
+{
+    return sh_resolve(sh, sh->cmdset, name);
+}
+
+/* ===========================
+ * Arg parsing (with quote support)
+ * =========================== */
+/* Length of an unquoted chain operator at p: ';', "&&" or "||" */
+static int chain_op_len(const char *p)
+{
+    if (p[0] == ';') return 1;
+    if ((p[0] == '&' || p[0] == '|') && p[1] == p[0]) return 2;
+    return 0;
+}
+
+/* Split one command of a chain into argv, in place. Stops after an
+ * unquoted ';', "&&" or "||": *op gets its first char and *next the
+ * text after it. At the end of the line *op is 0 and *next NULL. */
+static int build_argv(char *line, char **argv, int max_args,
+                      char **next, char *op)
+{
+    int argc = 0;
+    char *p = line;
+    enum { STATE_WHITESPACE, STATE_TOKEN, STATE_QUOTE } state = STATE_WHITESPACE;
+
+    *next = NULL;
+    *op = 0;
+
+    while (*p) {
+        int op_len;
+
+        switch (state) {
+        case STATE_WHITESPACE:
+            while (*p && isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (!*p) {
+                break; // End of line
+            }
+            if (chain_op_len(p)) {
+                state = STATE_TOKEN; /* Let the token state cut it */
+                break;
+            }
+            /* Words past max_args are dropped, the chain still parses */
+            if (*p == '"') {
+                if (argc < max_args) argv[argc++] = p + 1; // Start token *after* quote
+                state = STATE_QUOTE;
+                p++;
+            } else {
+                if (argc < max_args) argv[argc++] = p;
+                state = STATE_TOKEN;
+            }
+            break;
+
+        case STATE_TOKEN:
+            op_len = chain_op_len(p);
+            if (op_len) {
+                *op = *p;
+                *p = '\0';
+                *next = p + op_len;
+                argv[argc] = NULL;
+                return argc;
+            }
+            if (isspace((unsigned char)*p)) {
+                *p = '\0';
+                state = STATE_WHITESPACE;
+            }
+            p++;
+            break;
+
+        case STATE_QUOTE:
             if (*p == '"') {
                 *p = '\0';
                 state = STATE_WHITESPACE;
@@ -209,408 +1669,2165 @@ static int build_argv(char *line, char **argv, int max_args)
         }
     }
 
-    argv[argc] = NULL;
-    return argc;
+    argv[argc] = NULL;
+    return argc;
+}
+
+/* ===========================
+ * Argument schemas
+ *
+ * A command with a schema has its words checked and converted right
+ * after tokenizing, so a bad line never reaches the handler and the
+ * handler never parses strings itself. ENUM words are interned to
+ * their choice index; flags may sit anywhere between positionals.
+ * =========================== */
+#if SHELL_FEATURE_ARGS
+typedef char sh_args_fit_mask[(SHELL_MAX_ARGS <= 32) ? 1 : -1];
+
+static uint8_t args_count(const shell_ext_cmd_t *cmd)
+{
+    return cmd->nargs < SHELL_MAX_ARGS ? cmd->nargs : (uint8_t)SHELL_MAX_ARGS;
+}
+
+/* Schema index of the FLAG entry spelled `word`, or -1 */
+static int args_flag(const shell_ext_cmd_t *cmd, const char *word)
+{
+    for (uint8_t i = 0; i < args_count(cmd); i++) {
+        if (cmd->args[i].type == SHELL_ARG_FLAG && strcmp(cmd->args[i].name, word) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Next positional entry at or after pos */
+static uint8_t args_next_pos(const shell_ext_cmd_t *cmd, uint8_t pos)
+{
+    while (pos < args_count(cmd) && cmd->args[pos].type == SHELL_ARG_FLAG)
+        pos++;
+    return pos;
+}
+
+static bool args_convert(const shell_arg_spec_t *spec, const char *word, shell_arg_t *out)
+{
+    char *end;
+
+    switch (spec->type) {
+    case SHELL_ARG_INT: {
+        errno = 0;
+        long v = strtol(word, &end, 0);
+        if (end == word || *end || errno == ERANGE)
+            return false;
+#if LONG_MAX > 0x7FFFFFFFL
+        if (v < INT32_MIN || v > INT32_MAX)
+            return false;
+#endif
+        if (spec->min != spec->max && (v < spec->min || v > spec->max))
+            return false;
+        out->i = (int32_t)v;
+        return true;
+    }
+    case SHELL_ARG_HEX: {
+        if (!isxdigit((unsigned char)word[0]))
+            return false; /* strtoul would take a sign or blanks */
+        errno = 0;
+        unsigned long v = strtoul(word, &end, 16);
+        if (*end || errno == ERANGE)
+            return false;
+#if ULONG_MAX > 0xFFFFFFFFUL
+        if (v > UINT32_MAX)
+            return false;
+#endif
+        if (spec->max && v > (uint32_t)spec->max)
+            return false;
+        out->u = (uint32_t)v;
+        return true;
+    }
+    case SHELL_ARG_ENUM:
+        /* A handful of words in a const list: a scan beats any index */
+        for (uint32_t i = 0; spec->choices && spec->choices[i]; i++) {
+            if (strcmp(spec->choices[i], word) == 0) {
+                out->u = i;
+                return true;
+            }
+        }
+        return false;
+    default:
+        out->s = word;
+        return true;
+    }
+}
+
+/* usage: name <pos> [<optional>] [-flag]; ENUMs list their choices */
+static void args_usage(shell_t *sh, const shell_ext_cmd_t *cmd)
+{
+    sh_puts(sh, "usage: ");
+    sh_puts(sh, cmd->name);
+    for (uint8_t i = 0; i < args_count(cmd); i++) {
+        const shell_arg_spec_t *a = &cmd->args[i];
+        bool opt = a->optional || a->type == SHELL_ARG_FLAG;
+
+        sh_puts(sh, opt ? " [" : " ");
+        if (a->type == SHELL_ARG_FLAG) {
+            sh_puts(sh, a->name);
+        } else if (a->type == SHELL_ARG_ENUM && a->choices) {
+            for (uint8_t c = 0; a->choices[c]; c++) {
+                if (c) sh_putc(sh, '|');
+                sh_puts(sh, a->choices[c]);
+            }
+        } else {
+            sh_putc(sh, '<');
+            sh_puts(sh, a->name);
+            sh_putc(sh, '>');
+        }
+        if (opt) sh_putc(sh, ']');
+    }
+    sh_puts(sh, "\r\n");
+}
+
+/* "name: what [entry] ['word']" and the usage line */
+static bool args_fail(shell_t *sh, const shell_ext_cmd_t *cmd, bool verbose,
+                      const char *what, const char *entry, const char *word)
+{
+    if (!verbose) return false;
+    sh_puts(sh, cmd->name);
+    sh_puts(sh, ": ");
+    sh_puts(sh, what);
+    if (entry) {
+        sh_putc(sh, ' ');
+        sh_puts(sh, entry);
+    }
+    if (word) {
+        sh_puts(sh, " '");
+        sh_puts(sh, word);
+        sh_putc(sh, '\'');
+    }
+    sh_puts(sh, "\r\n");
+    args_usage(sh, cmd);
+    return false;
+}
+
+/* Check argv against cmd's schema and fill out. With verbose set a
+ * mismatch prints what was wrong and the usage line. */
+static bool args_parse(shell_t *sh, const shell_ext_cmd_t *cmd, int argc, char **argv,
+                       shell_args_t *out, bool verbose)
+{
+    out->argc  = argc;
+    out->argv  = argv;
+    out->given = 0;
+    if (!cmd->args) return true;
+    memset(out->v, 0, sizeof out->v);
+
+    uint8_t pos = 0;
+    for (int w = 1; w < argc; w++) {
+        int f = args_flag(cmd, argv[w]);
+        if (f >= 0) {
+            out->v[f].b = true;
+            out->given |= 1u << f;
+            continue;
+        }
+
+        pos = args_next_pos(cmd, pos);
+        if (pos >= args_count(cmd))
+            return args_fail(sh, cmd, verbose, "too many arguments", NULL, NULL);
+        if (!args_convert(&cmd->args[pos], argv[w], &out->v[pos]))
+            return args_fail(sh, cmd, verbose, "bad", cmd->args[pos].name, argv[w]);
+        out->given |= 1u << pos;
+        pos++;
+    }
+
+    for (pos = args_next_pos(cmd, pos); pos < args_count(cmd);
+         pos = args_next_pos(cmd, (uint8_t)(pos + 1))) {
+        if (!cmd->args[pos].optional)
+            return args_fail(sh, cmd, verbose, "missing", cmd->args[pos].name, NULL);
+    }
+    return true;
+}
+#else
+#define args_parse(sh, cmd, argc, argv, out, verbose) ((void)(out), true)
+#endif
+
+/* ===========================
+ * Escape parsing
+ * =========================== */
+/* The decoder is a DFA over byte classes. Each cell of esc_dfa holds
+ * the next state in the high nibble and the action in the low one;
+ * the few actions that finish a sequence go through esc_dispatch(). */
+enum { ES_GROUND, ES_ESC, ES_CSI, ES_SS3, ES_COUNT };
+
+enum {
+    EC_OTHER,   /* C0 controls, 8-bit bytes */
+    EC_ESC,
+    EC_DIGIT,
+    EC_SEMI,
+    EC_LBRACK,
+    EC_O,
+    EC_INTER,   /* Space .. '?' that is not a digit or ';' */
+    EC_FINAL,   /* '@' .. '~' */
+    EC_DEL,
+    EC_COUNT
+};
+
+enum {
+    EA_PASS,    /* Not ours, handle the byte normally */
+    EA_WAIT,    /* Swallow, sequence continues */
+    EA_PARAM,   /* Accumulate a digit */
+    EA_NEXT,    /* ';' starts the next parameter */
+    EA_PRIVATE, /* '?', '>' ...: a reply, not a key */
+    EA_META,    /* ESC ESC: Alt on top of the next sequence */
+    EA_RESTART, /* ESC inside a sequence abandons it */
+    EA_CANCEL,  /* Control byte abandons the sequence, then runs */
+    EA_ALT,     /* ESC + key */
+    EA_CSI,     /* CSI final byte */
+    EA_SS3      /* SS3 final byte */
+};
+
+#define EF_ALT      0x01
+#define EF_PRIVATE  0x02
+
+#define ESC_CELL(state, action) (uint8_t)((ES_##state << 4) | EA_##action)
+
+static const uint8_t esc_dfa[ES_COUNT][EC_COUNT] = {
+    [ES_GROUND] = {
+        [EC_OTHER]  = ESC_CELL(GROUND, PASS),
+        [EC_ESC]    = ESC_CELL(ESC,    WAIT),
+        [EC_DIGIT]  = ESC_CELL(GROUND, PASS),
+        [EC_SEMI]   = ESC_CELL(GROUND, PASS),
+        [EC_LBRACK] = ESC_CELL(GROUND, PASS),
+        [EC_O]      = ESC_CELL(GROUND, PASS),
+        [EC_INTER]  = ESC_CELL(GROUND, PASS),
+        [EC_FINAL]  = ESC_CELL(GROUND, PASS),
+        [EC_DEL]    = ESC_CELL(GROUND, PASS),
+    },
+    [ES_ESC] = {
+        [EC_OTHER]  = ESC_CELL(GROUND, CANCEL),
+        [EC_ESC]    = ESC_CELL(ESC,    META),
+        [EC_DIGIT]  = ESC_CELL(GROUND, ALT),
+        [EC_SEMI]   = ESC_CELL(GROUND, ALT),
+        [EC_LBRACK] = ESC_CELL(CSI,    WAIT),
+        [EC_O]      = ESC_CELL(SS3,    WAIT),
+        [EC_INTER]  = ESC_CELL(GROUND, ALT),
+        [EC_FINAL]  = ESC_CELL(GROUND, ALT),
+        [EC_DEL]    = ESC_CELL(GROUND, ALT),
+    },
+    [ES_CSI] = {
+        [EC_OTHER]  = ESC_CELL(GROUND, CANCEL),
+        [EC_ESC]    = ESC_CELL(ESC,    RESTART),
+        [EC_DIGIT]  = ESC_CELL(CSI,    PARAM),
+        [EC_SEMI]   = ESC_CELL(CSI,    NEXT),
+        [EC_LBRACK] = ESC_CELL(CSI,    PRIVATE),
+        [EC_O]      = ESC_CELL(GROUND, CSI),
+        [EC_INTER]  = ESC_CELL(CSI,    PRIVATE),
+        [EC_FINAL]  = ESC_CELL(GROUND, CSI),
+        [EC_DEL]    = ESC_CELL(CSI,    WAIT),
+    },
+    [ES_SS3] = {
+        [EC_OTHER]  = ESC_CELL(GROUND, CANCEL),
+        [EC_ESC]    = ESC_CELL(ESC,    RESTART),
+        [EC_DIGIT]  = ESC_CELL(SS3,    PARAM),
+        [EC_SEMI]   = ESC_CELL(SS3,    NEXT),
+        [EC_LBRACK] = ESC_CELL(GROUND, SS3),
+        [EC_O]      = ESC_CELL(GROUND, SS3),
+        [EC_INTER]  = ESC_CELL(GROUND, CANCEL),
+        [EC_FINAL]  = ESC_CELL(GROUND, SS3),
+        [EC_DEL]    = ESC_CELL(SS3,    WAIT),
+    },
+};
+
+#undef ESC_CELL
+
+/* Final byte of CSI / SS3 -> key; both introducers share it */
+static const struct { char final; uint8_t key; } esc_finals[] = {
+    { 'A', SHELL_KEY_UP },   { 'B', SHELL_KEY_DOWN },
+    { 'C', SHELL_KEY_RIGHT },{ 'D', SHELL_KEY_LEFT },
+    { 'H', SHELL_KEY_HOME }, { 'F', SHELL_KEY_END },
+    { 'P', SHELL_KEY_F1 },   { 'Q', SHELL_KEY_F2 },
+    { 'R', SHELL_KEY_F3 },   { 'S', SHELL_KEY_F4 },
+    { 'Z', SHELL_KEY_TAB },  /* Shift+Tab, treat as Tab */
+};
+
+/* ESC[<n>~ -> key (1/4 and 7/8 are the vt220 and rxvt Home/End) */
+static const struct { uint8_t code; uint8_t key; } esc_tilde[] = {
+    { 1,  SHELL_KEY_HOME }, { 2,  SHELL_KEY_INS },  { 3,  SHELL_KEY_DEL },
+    { 4,  SHELL_KEY_END },  { 5,  SHELL_KEY_PGUP }, { 6,  SHELL_KEY_PGDN },
+    { 7,  SHELL_KEY_HOME }, { 8,  SHELL_KEY_END },
+    { 11, SHELL_KEY_F1 },   { 12, SHELL_KEY_F2 },   { 13, SHELL_KEY_F3 },
+    { 14, SHELL_KEY_F4 },   { 15, SHELL_KEY_F5 },   { 17, SHELL_KEY_F6 },
+    { 18, SHELL_KEY_F7 },   { 19, SHELL_KEY_F8 },   { 20, SHELL_KEY_F9 },
+    { 21, SHELL_KEY_F10 },  { 23, SHELL_KEY_F11 },  { 24, SHELL_KEY_F12 },
+};
+
+#define ESC_PASTE_BEGIN 200
+#define ESC_PASTE_END   201
+
+static uint8_t esc_class(int ch)
+{
+    if (ch == 0x1B)              return EC_ESC;
+    if (ch >= '0' && ch <= '9')  return EC_DIGIT;
+    if (ch == ';')               return EC_SEMI;
+    if (ch == '[')               return EC_LBRACK;
+    if (ch == 'O')               return EC_O;
+    if (ch >= 0x20 && ch < 0x40) return EC_INTER;
+    if (ch >= 0x40 && ch < 0x7F) return EC_FINAL;
+    if (ch == 0x7F)              return EC_DEL;
+    return EC_OTHER;
+}
+
+static void esc_reset(shell_esc_t *e)
+{
+    e->state = ES_GROUND;
+    e->num_params = 0;
+    e->flags = 0;
+    for (int i = 0; i < 4; i++) e->params[i] = 0;
+}
+
+/* xterm modifier parameter: 1 + (Shift=1 | Alt=2 | Ctrl=4 | Meta=8) */
+static unsigned esc_mods(uint16_t p)
+{
+    unsigned mods = 0;
+    if (p < 2) return 0;
+    p--;
+    if (p & 1)   mods |= SHELL_MOD_SHIFT;
+    if (p & 0xA) mods |= SHELL_MOD_ALT;
+    if (p & 4)   mods |= SHELL_MOD_CTRL;
+    return mods;
+}
+
+static sh_parse_result_t esc_dispatch(shell_esc_t *e, uint8_t action,
+                                      int ch, shell_key_t *out_key)
+{
+    unsigned mods = (e->flags & EF_ALT) ? SHELL_MOD_ALT : 0;
+    unsigned key = SHELL_KEY_NONE;
+
+    if (action == EA_ALT) {
+        key = (ch == 0x7F) ? SHELL_KEY_BACKSPACE
+                           : (unsigned)SHELL_KEY_CHAR | (unsigned)ch;
+        mods = SHELL_MOD_ALT;
+    } else if (e->flags & EF_PRIVATE) {
+        key = SHELL_KEY_NONE;
+    } else if (ch == '~' && action == EA_CSI) {
+        if (e->num_params == 0) return SH_PARSE_COMPLETE;
+        if (e->params[0] == ESC_PASTE_BEGIN) return SH_PARSE_PASTE_BEGIN;
+        if (e->params[0] == ESC_PASTE_END)   return SH_PARSE_PASTE_END;
+        for (size_t i = 0; i < sizeof esc_tilde / sizeof esc_tilde[0]; i++) {
+            if (esc_tilde[i].code == e->params[0]) {
+                key = esc_tilde[i].key;
+                break;
+            }
+        }
+        if (e->num_params > 1) mods |= esc_mods(e->params[1]);
+    } else {
+        for (size_t i = 0; i < sizeof esc_finals / sizeof esc_finals[0]; i++) {
+            if (esc_finals[i].final == ch) {
+                key = esc_finals[i].key;
+                break;
+            }
+        }
+        /* ESC[1;5C, and the older SS3 form ESC O5C */
+        if (e->num_params > 1)
+            mods |= esc_mods(e->params[e->num_params - 1]);
+        else if (e->num_params == 1 && action == EA_SS3)
+            mods |= esc_mods(e->params[0]);
+    }
+
+    *out_key = (key != SHELL_KEY_NONE) ? (shell_key_t)(key | mods)
+                                       : SHELL_KEY_NONE;
+    return SH_PARSE_COMPLETE;
+}
+
+static sh_parse_result_t esc_parse(shell_t *sh, int ch, shell_key_t *out_key)
+{
+    shell_esc_t *e = &sh->esc;
+    uint8_t cell = esc_dfa[e->state][esc_class(ch)];
+    uint8_t action = (uint8_t)(cell & 0x0F);
+    sh_parse_result_t res;
+
+    *out_key = SHELL_KEY_NONE;
+    e->state = (uint8_t)(cell >> 4);
+
+    switch (action) {
+    case EA_PASS:
+        return SH_PARSE_NONE;
+    case EA_WAIT:
+        return SH_PARSE_CONTINUE;
+    case EA_PARAM: {
+        if (e->num_params == 0) e->num_params = 1;
+        uint16_t *p = &e->params[e->num_params - 1];
+        if (*p < 6553) *p = (uint16_t)(*p * 10 + (ch - '0'));
+        return SH_PARSE_CONTINUE;
+    }
+    case EA_NEXT:
+        if (e->num_params == 0) e->num_params = 1; /* ";5" = "1;5" */
+        if (e->num_params < 4) e->params[e->num_params++] = 0;
+        return SH_PARSE_CONTINUE;
+    case EA_PRIVATE:
+        e->flags |= EF_PRIVATE;
+        return SH_PARSE_CONTINUE;
+    case EA_META:
+        e->flags |= EF_ALT;
+        return SH_PARSE_CONTINUE;
+    case EA_RESTART:
+        esc_reset(e);
+        e->state = ES_ESC;
+        return SH_PARSE_CONTINUE;
+    case EA_CANCEL:
+        MT_ADD(sh, esc_errors, 1);
+        esc_reset(e);
+        return SH_PARSE_NONE;
+    default:
+#if SHELL_FEATURE_WRAP
+        /* ESC[<row>;<col>R answers shell_query_term_width(). Columns up
+         * to 16 are taken for F3 with xterm modifiers (ESC[1;5R). */
+        if (sh->term_query && action == EA_CSI && ch == 'R' &&
+            e->num_params == 2 && e->params[1] > 16) {
+            sh->term_query = false;
+            sh->term_cols  = e->params[1];
+            esc_reset(e);
+            return SH_PARSE_COMPLETE;
+        }
+#endif
+        res = esc_dispatch(e, action, ch, out_key);
+        if (res == SH_PARSE_COMPLETE && *out_key == SHELL_KEY_NONE)
+            MT_ADD(sh, esc_errors, 1);
+        esc_reset(e);
+        return res;
+    }
+}
+
+static void sh_redraw_line(shell_t *sh);
+
+#if SHELL_FEATURE_HISTORY
+/* ===========================
+ * History management
+ * =========================== */
+
+/*
+ * history[] is a byte ring of packed entries, oldest at history_tail:
+ *
+ *   [len][text...][NUL][len]   len is 1 byte, or 2 when lines can exceed 255
+ *
+ * An entry never straddles the end of the ring; when it would, a zero
+ * length marker (or a tail too short for a header) sends readers back to
+ * offset 0, and history_wrap remembers where the entries before offset 0
+ * end. The trailing copy of len lets browsing and Ctrl+R step to older
+ * entries without walking from the tail. Entries are addressed by offset
+ * so shell_get_history_entry() can hand out the NUL-terminated text in
+ * place.
+ */
+#define HIST_HDR ((SHELL_LINEBUF_SIZE > 256) ? 2 : 1)
+#define HIST_SIZE(len) (HIST_HDR + (len) + 1 + HIST_HDR)
+
+typedef char sh_history_fits_line[(SHELL_HISTORY_BYTES >= SHELL_LINEBUF_SIZE + 2 * HIST_HDR &&
+                                   SHELL_HISTORY_BYTES <= 0xFFFF) ? 1 : -1];
+
+static uint16_t hist_len(const shell_t *sh, uint16_t off)
+{
+    uint16_t len = sh->history[off];
+#if SHELL_LINEBUF_SIZE > 256
+    len |= (uint16_t)(sh->history[off + 1] << 8);
+#endif
+    return len;
+}
+
+static void hist_set_len(shell_t *sh, uint16_t off, uint16_t len)
+{
+    sh->history[off] = (uint8_t)len;
+#if SHELL_LINEBUF_SIZE > 256
+    sh->history[off + 1] = (uint8_t)(len >> 8);
+#endif
+}
+
+static const char *hist_text(const shell_t *sh, uint16_t off)
+{
+    return (const char *)&sh->history[off + HIST_HDR];
+}
+
+/* Offset just after the entry at off, where the next one would be */
+static uint16_t hist_end(const shell_t *sh, uint16_t off)
+{
+    uint16_t end = (uint16_t)(off + HIST_SIZE(hist_len(sh, off)));
+    if (SHELL_HISTORY_BYTES - end < HIST_HDR)
+        end = 0;
+    return end;
+}
+
+/* Entry following the one at off (only valid if there is one) */
+static uint16_t hist_next(const shell_t *sh, uint16_t off)
+{
+    uint16_t next = hist_end(sh, off);
+    return hist_len(sh, next) ? next : 0;
+}
+
+/* Entry before the one at off (only valid if off is not the oldest) */
+static uint16_t hist_prev(const shell_t *sh, uint16_t off)
+{
+    uint16_t end = off ? off : sh->history_wrap;
+    uint16_t len = hist_len(sh, (uint16_t)(end - HIST_HDR));
+    return (uint16_t)(end - HIST_SIZE(len));
+}
+
+/* Offset of the index-th entry, 0 = oldest */
+static uint16_t hist_at(const shell_t *sh, uint16_t index)
+{
+    uint16_t off = sh->history_tail;
+    while (index--)
+        off = hist_next(sh, off);
+    return off;
+}
+
+static void hist_evict_oldest(shell_t *sh)
+{
+    sh->history_used = (uint16_t)(sh->history_used - HIST_SIZE(hist_len(sh, sh->history_tail)));
+    sh->history_tail = hist_next(sh, sh->history_tail);
+    sh->history_count--;
+    if (sh->history_pos > 0)
+        sh->history_pos--;
+    else if (sh->history_pos == 0)
+        sh->history_off = sh->history_tail;
+}
+
+/* Evict oldest entries until size contiguous bytes are free; returns the
+ * offset to write at. */
+static uint16_t hist_make_room(shell_t *sh, uint16_t size)
+{
+    for (;;) {
+        if (sh->history_count == 0) {
+            sh->history_tail = sh->history_head = 0;
+            return 0;
+        }
+        uint16_t head = sh->history_head, tail = sh->history_tail;
+        if (head > tail) {
+            /* Live span is [tail, head): free space at the end, then the front */
+            if (SHELL_HISTORY_BYTES - head >= size)
+                return head;
+            if (tail >= size) {
+                if (SHELL_HISTORY_BYTES - head >= HIST_HDR)
+                    hist_set_len(sh, head, 0); /* Wrap marker */
+                sh->history_wrap = head;
+                return 0;
+            }
+        } else if (tail - head >= size) {
+            /* Wrapped: the gap between head and tail is all that is free */
+            return head;
+        }
+        hist_evict_oldest(sh);
+    }
+}
+
+/* Returns false if the line was empty or repeats the newest entry */
+static bool hist_add(shell_t *sh, const char *line, size_t len)
+{
+    if (len == 0) return false;
+
+    /* Don't add duplicate of last command */
+    if (sh->history_count > 0 &&
+        strcmp(hist_text(sh, sh->history_last), line) == 0)
+        return false;
+
+    uint16_t size = (uint16_t)HIST_SIZE(len);
+    uint16_t off  = hist_make_room(sh, size);
+
+    hist_set_len(sh, off, (uint16_t)len);
+    memcpy(&sh->history[off + HIST_HDR], line, len);
+    sh->history[off + HIST_HDR + len] = '\0';
+    hist_set_len(sh, (uint16_t)(off + size - HIST_HDR), (uint16_t)len);
+
+    sh->history_last = off;
+    sh->history_head = hist_end(sh, off);
+    if (sh->history_head == 0)
+        sh->history_wrap = (uint16_t)(off + size);
+    sh->history_used = (uint16_t)(sh->history_used + size);
+    sh->history_count++;
+    return true;
+}
+
+/* ===========================
+ * Persistent history log
+ *
+ * Records are appended back to back from offset 0:
+ *
+ *   [len lo][len hi][text...][crc8]
+ *
+ * An erased length (0xFFFF) ends the log. The crc covers the length and
+ * the text and is never stored as 0xFF, so a record torn by a reset
+ * mid-append (its crc byte still erased) is always recognised.
+ * =========================== */
+#define HS_ERASED 0xFFFFu
+
+enum { HS_OK, HS_FULL, HS_IO };
+
+static uint8_t hs_crc8(uint8_t crc, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        crc ^= *p++;
+        for (uint8_t b = 0; b < 8; b++)
+            crc = (uint8_t)((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+    }
+    return crc;
+}
+
+static uint8_t hs_record_crc(const uint8_t hdr[2], const void *text, uint16_t len)
+{
+    uint8_t crc = hs_crc8(hs_crc8(0, hdr, 2), (const uint8_t *)text, len);
+    return crc == 0xFF ? 0xFE : crc;
+}
+
+static int hs_append(shell_t *sh, const char *line, uint16_t len)
+{
+    const shell_history_store_t *st = sh->history_store;
+    uint32_t off = sh->history_store_off;
+    uint8_t  hdr[2] = { (uint8_t)len, (uint8_t)(len >> 8) };
+    uint8_t  crc = hs_record_crc(hdr, line, len);
+
+    if (off > st->size || st->size - off < (uint32_t)len + 3)
+        return HS_FULL;
+    /* Once started, the record is consumed whatever happens */
+    sh->history_store_off = off + len + 3;
+    if (st->append(st->ctx, off, hdr, 2) != 0 ||
+        st->append(st->ctx, off + 2, line, len) != 0 ||
+        st->append(st->ctx, off + 2 + len, &crc, 1) != 0)
+        return HS_IO;
+    return HS_OK;
+}
+
+/* Log full: erase and rewrite the newest entries that fit. A store that
+ * fails to erase or to take the rewrite is detached: what it holds is
+ * not the ring, and retrying would erase on every add. */
+static void hs_compact(shell_t *sh)
+{
+    const shell_history_store_t *st = sh->history_store;
+    uint32_t need = 0;
+    uint16_t skip = 0, off = sh->history_tail;
+
+    if (st->erase(st->ctx) != 0) {
+        sh->history_store = NULL;
+        return;
+    }
+    sh->history_store_off = 0;
+
+    for (uint16_t i = 0; i < sh->history_count; i++) {
+        need += (uint32_t)hist_len(sh, off) + 3;
+        off = hist_next(sh, off);
+    }
+    off = sh->history_tail;
+    while (need > st->size) {
+        need -= (uint32_t)hist_len(sh, off) + 3;
+        off = hist_next(sh, off);
+        skip++;
+    }
+    for (uint16_t i = skip; i < sh->history_count; i++) {
+        if (hs_append(sh, hist_text(sh, off), hist_len(sh, off)) != HS_OK) {
+            sh->history_store = NULL;
+            return;
+        }
+        off = hist_next(sh, off);
+    }
+}
+
+/* Replay the log into the ring; linebuf serves as the read buffer */
+static void hs_replay(shell_t *sh)
+{
+    const shell_history_store_t *st = sh->history_store;
+    uint32_t off = 0;
+
+    for (;;) {
+        uint8_t  hdr[2], crc;
+        uint16_t len;
+
+        if (st->size - off < 2 || st->read(st->ctx, off, hdr, 2) != 0)
+            break;
+        len = (uint16_t)(hdr[0] | (hdr[1] << 8));
+        if (len == HS_ERASED) {
+            sh->history_store_off = off;
+            sh->linebuf[0] = '\0';
+            return;
+        }
+        if (len == 0 || len > SHELL_LINEBUF_SIZE - 1 || st->size - off < (uint32_t)len + 3 ||
+            st->read(st->ctx, off + 2, sh->linebuf, len) != 0 ||
+            st->read(st->ctx, off + 2 + len, &crc, 1) != 0 ||
+            crc != hs_record_crc(hdr, sh->linebuf, len))
+            break;
+        sh->linebuf[len] = '\0';
+        hist_add(sh, sh->linebuf, len);
+        off += (uint32_t)len + 3;
+    }
+
+    /* Corrupt or torn tail (or no end marker): compact on the next add */
+    sh->history_store_off = st->size;
+    sh->linebuf[0] = '\0';
+}
+
+static void sh_add_history(shell_t *sh, const char *line)
+{
+    size_t len = strlen(line);
+    if (len > SHELL_LINEBUF_SIZE - 1)
+        len = SHELL_LINEBUF_SIZE - 1;
+    if (!hist_add(sh, line, len) || !sh->history_store)
+        return;
+
+    /* A torn record ends the replay, hiding everything written after it,
+     * so a failed write compacts on the next add rather than now */
+    int r = hs_append(sh, line, (uint16_t)len);
+    if (r == HS_FULL)
+        hs_compact(sh);
+    else if (r == HS_IO)
+        sh->history_store_off = sh->history_store->size;
+}
+
+void shell_add_history(shell_t *sh, const char *line)
+{
+    if (!sh || !line) return;
+    sh_lock(sh);
+    sh_add_history(sh, line);
+    sh_unlock(sh);
+}
+
+void shell_set_history_store(shell_t *sh, const shell_history_store_t *store)
+{
+    if (!sh) return;
+    sh->history_store = NULL;
+    if (!store || !store->read || !store->append || !store->erase)
+        return;
+    sh->history_store = store;
+    sh->history_store_off = 0;
+    hs_replay(sh);
+}
+
+static void history_prev(shell_t *sh)
+{
+    if (sh->history_count == 0) return;
+
+    if (sh->history_pos == -1) {
+        /* Save current line before browsing */
+        memcpy(sh->history_saved, sh->linebuf, (size_t)sh->line_len + 1);
+        sh->history_pos = (int16_t)(sh->history_count - 1);
+        sh->history_off = sh->history_last;
+    } else {
+        if (sh->history_pos == 0) return; /* Already at the oldest */
+        sh->history_pos--;
+        sh->history_off = hist_prev(sh, sh->history_off);
+    }
+
+    sh_render_set_line(sh, hist_text(sh, sh->history_off));
+}
+
+static void history_next(shell_t *sh)
+{
+    if (sh->history_pos == -1) return;
+
+    if (sh->history_pos + 1 >= sh->history_count) {
+        /* Restore saved line */
+        sh->history_pos = -1;
+        sh_render_set_line(sh, sh->history_saved);
+    } else {
+        sh->history_pos++;
+        sh->history_off = hist_next(sh, sh->history_off);
+        sh_render_set_line(sh, hist_text(sh, sh->history_off));
+    }
+}
+
+/* ===========================
+ * Reverse incremental search (Ctrl+R)
+ *
+ * The line shows  (reverse-i-search)`query': match  with the match in
+ * linebuf, so the query part acts as a longer prompt. Query edits are a
+ * single CSI @ / CSI P at the end of the query; the match is repainted
+ * through sh_render_set_line(), which skips the common prefix.
+ * =========================== */
+#define SR_PREFIX     "(reverse-i-search)`"
+#define SR_PREFIX_LEN 19
+#define SR_SUFFIX_LEN 3 /* "': " */
+
+static void sr_bell(shell_t *sh)
+{
+    if (sh->echo_enabled) sh_putc(sh, '\a');
+}
+
+static void sr_draw(shell_t *sh)
+{
+    if (sh->echo_enabled)
+        sh_goto(sh, sh->prompt_len + sh->term_cursor, 0); /* First row */
+    sh->prompt_len = (uint8_t)(SR_PREFIX_LEN + sh->search_len + SR_SUFFIX_LEN);
+    if (!sh->echo_enabled) return;
+    sh_puts(sh, SR_PREFIX);
+    sh_write(sh, sh->search_query, sh->search_len);
+    sh_puts(sh, "': ");
+    sh->term_cursor = 0;
+    sh_emit(sh, 0, sh->line_len);
+    sh_puts(sh, sh_cols(sh) ? ANSI_CLEAR_BELOW : ANSI_CLEAR_LINE_FROM_CURSOR);
+    sh->term_len = sh->line_len;
+    sh_move_cursor(sh, sh->cursor_pos);
+}
+
+/* Query edits shift everything after them; the CSI @ / P shortcut only
+ * holds while the search line stays on one row */
+static bool sr_one_row(const shell_t *sh, unsigned grow)
+{
+    unsigned cols = sh_cols(sh);
+    return !cols || sh->prompt_len + grow + sh->term_len < cols;
+}
+
+/* Terminal cursor: line offset -> just after the query, and back */
+static void sr_to_query_end(shell_t *sh)
+{
+    sh_csi(sh, (unsigned int)(SR_SUFFIX_LEN + sh->term_cursor), 'D');
+}
+
+static void sr_from_query_end(shell_t *sh)
+{
+    sh_csi(sh, (unsigned int)(SR_SUFFIX_LEN + sh->term_cursor), 'C');
+}
+
+/*
+ * Show the newest entry at or below index `from` (at offset off) that
+ * contains the query, walking back towards the oldest. A step to the next
+ * older match only touches the entries in between.
+ */
+static bool sr_find(shell_t *sh, int16_t from, uint16_t off)
+{
+    for (int16_t i = from;; i--) {
+        const char *text = hist_text(sh, off);
+        const char *m = strstr(text, sh->search_query);
+        if (m) {
+            sh->history_pos = i;
+            sh->history_off = off;
+            sh_render_set_line(sh, text);
+            sh->cursor_pos = (uint16_t)(m - text);
+            if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
+            return true;
+        }
+        if (i == 0) return false;
+        off = hist_prev(sh, off);
+    }
+}
+
+/* Search from the entry just older than the match, or from the newest */
+static bool sr_find_older(shell_t *sh)
+{
+    if (sh->history_pos == 0) return false;
+    if (sh->history_pos > 0)
+        return sr_find(sh, (int16_t)(sh->history_pos - 1),
+                       hist_prev(sh, sh->history_off));
+    return sh->history_count && sr_find(sh, (int16_t)(sh->history_count - 1),
+                                        sh->history_last);
+}
+
+static void sr_start(shell_t *sh)
+{
+    if (sh->history_pos == -1)
+        memcpy(sh->history_saved, sh->linebuf, (size_t)sh->line_len + 1);
+    sh->search_active = true;
+    sh->search_len = 0;
+    sh->search_query[0] = '\0';
+    sr_draw(sh);
+}
+
+/* Leave search mode, keeping the match (accept) or the original line */
+static void sr_end(shell_t *sh, bool accept)
+{
+    sh->search_active = false;
+    if (!accept) {
+        sh->history_pos = -1;
+        sh_render_set_line(sh, sh->history_saved);
+    }
+    sh_redraw_line(sh);
+}
+
+/* A longer query only matches a subset: keep the current match if it
+ * still contains the query, else look further back from it */
+static void sr_add_char(shell_t *sh, char c)
+{
+    if (sh->search_len >= SHELL_SEARCH_MAX - 1) {
+        sr_bell(sh);
+        return;
+    }
+    bool one_row = sr_one_row(sh, 1);
+    if (sh->echo_enabled && one_row) {
+        sr_to_query_end(sh);
+        sh_csi(sh, 1, '@');
+        sh_putc(sh, c);
+        sr_from_query_end(sh);
+    }
+    sh->search_query[sh->search_len++] = c;
+    sh->search_query[sh->search_len] = '\0';
+    if (one_row)
+        sh->prompt_len++;
+    else
+        sr_draw(sh);
+
+    if (sh->history_pos >= 0) {
+        const char *text = hist_text(sh, sh->history_off);
+        const char *m = strstr(text, sh->search_query);
+        if (m) {
+            sh_render_set_line(sh, text); /* No-op unless the line was edited */
+            sh->cursor_pos = (uint16_t)(m - text);
+            if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
+            return;
+        }
+    }
+    if (!sr_find_older(sh))
+        sr_bell(sh);
+}
+
+/* A shorter query can match newer entries again: rescan from the top */
+static void sr_backspace(shell_t *sh)
+{
+    if (sh->search_len == 0) {
+        sr_bell(sh);
+        return;
+    }
+    if (!sr_one_row(sh, 0)) {
+        sh->search_query[--sh->search_len] = '\0';
+        sr_draw(sh);
+    } else {
+        if (sh->echo_enabled) {
+            sr_to_query_end(sh);
+            sh_putc(sh, '\b');
+            sh_csi(sh, 1, 'P');
+            sh->prompt_len--;
+            sr_from_query_end(sh);
+        } else {
+            sh->prompt_len--;
+        }
+        sh->search_query[--sh->search_len] = '\0';
+    }
+
+    if (sh->search_len > 0 && sh->history_count)
+        sr_find(sh, (int16_t)(sh->history_count - 1), sh->history_last);
+}
+
+/* Ctrl+R again: next older match */
+static void sr_next(shell_t *sh)
+{
+    if (!sr_find_older(sh))
+        sr_bell(sh);
+}
+
+/* Keys while searching. Returns false to let the key run normally. */
+static bool sr_key(shell_t *sh, shell_key_t key)
+{
+    switch (key) {
+    case SHELL_KEY_CTRL_R:
+        sr_next(sh);
+        return true;
+    case SHELL_KEY_CTRL_C:
+        sh->search_active = false; /* ^C drops the line anyway */
+        return false;
+    default:
+        sr_end(sh, true);
+        return false;
+    }
+}
+
+/* Plain characters while searching. Returns false to let it run normally. */
+static bool sr_char(shell_t *sh, int ch)
+{
+    if (ch == 0x07) {                   /* Ctrl+G: cancel */
+        sr_end(sh, false);
+        return true;
+    }
+    if (ch == 0x7F || ch == '\b') {
+        sr_backspace(sh);
+        return true;
+    }
+    if (ch >= 0x20 && ch < 0x7F) {
+        sr_add_char(sh, (char)ch);
+        return true;
+    }
+    sr_end(sh, true);
+    return false;
+}
+#else
+void shell_add_history(shell_t *sh, const char *line)
+{
+    (void)sh; (void)line;
+}
+
+void shell_set_history_store(shell_t *sh, const shell_history_store_t *store)
+{
+    (void)sh; (void)store;
+}
+#endif /* SHELL_FEATURE_HISTORY */
+
+/* ===========================
+ * Login
+ * =========================== */
+#if SHELL_FEATURE_LOGIN
+static void login_reset(shell_t *sh)
+{
+    sh->login_state = 0;
+    sh->login_idx   = 0;
+    memset(sh->login_user, 0, sizeof sh->login_user);
+    memset(sh->login_pass, 0, sizeof sh->login_pass);
+}
+
+static void login_prompt_user(shell_t *sh)
+{
+    sh_puts(sh, "login: ");
+    sh->login_idx = 0;
+}
+
+static void login_prompt_pass(shell_t *sh)
+{
+    sh_puts(sh, "password: ");
+    sh->login_idx = 0;
+}
+#endif
+
+/* First prompt of a session, after login if there is one */
+static void sh_session_start(shell_t *sh)
+{
+#if SHELL_BRACKETED_PASTE
+    sh_puts(sh, ANSI_BRACKETED_PASTE_ON);
+#endif
+#if SHELL_FEATURE_WRAP && SHELL_TERM_QUERY
+    if (!sh->term_cols) {
+        sh_puts(sh, ANSI_QUERY_WIDTH);
+        sh->term_query = true;
+    }
+#endif
+    sh_prompt(sh);
+}
+
+#if SHELL_FEATURE_LOGIN
+static void handle_login(shell_t *sh, int ch)
+{
+    switch (sh->login_state) {
+    case 0:
+        if (ch == (unsigned char)sh->login_trigger) {
+            sh->login_state = 1;
+            login_prompt_user(sh);
+        }
+        break;
+    case 1: /* username */
+        if (ch == '\r' || ch == '\n') {
+            sh_putc(sh, '\r'); sh_putc(sh, '\n');
+            sh->login_user[sh->login_idx] = 0;
+            sh->login_state = 2;
+            login_prompt_pass(sh);
+        } else if (ch == 0x7F || ch == '\b') {
+            if (sh->login_idx) {
+                sh->login_idx--;
+                sh_putc(sh, '\b'); sh_putc(sh, ' '); sh_putc(sh, '\b');
+            }
+        } else if (sh->login_idx < sizeof sh->login_user - 1) {
+            sh->login_user[sh->login_idx++] = (char)ch;
+            sh_putc(sh, (char)ch);
+        }
+        break;
+    case 2: /* password */
+        if (ch == '\r' || ch == '\n') {
+            sh_putc(sh, '\r'); sh_putc(sh, '\n');
+            sh->login_pass[sh->login_idx] = 0;
+            bool ok = false;
+            if (sh->login_cb)
+                ok = sh->login_cb(sh->login_user, sh->login_pass);
+            if (ok) {
+                sh->logged_in = true;
+                login_reset(sh);
+                sh_session_start(sh);
+            } else {
+                sh_puts(sh, "Login failed\r\n");
+                login_reset(sh);
+            }
+        } else if (ch == 0x7F || ch == '\b') {
+            if (sh->login_idx) {
+                sh->login_idx--;
+            }
+        } else if (sh->login_idx < sizeof sh->login_pass - 1) {
+            sh->login_pass[sh->login_idx++] = (char)ch;
+        }
+        break;
+    }
+}
+
+#endif /* SHELL_FEATURE_LOGIN */
+
+/* ===========================
+ * Line editor + exec
+ * =========================== */
+static void reset_line(shell_t *sh)
+{
+    sh->cursor_pos = 0;
+#if SHELL_FEATURE_HISTORY
+    sh->history_pos = -1;
+#endif
+    /* Only [0, line_len] can hold text or build_argv's cuts */
+    memset(sh->linebuf, 0, (size_t)sh->line_len + 1);
+    sh->line_len   = 0;
+}
+
+/* ===========================
+ * Resumable commands
+ *
+ * A step command owns the session until it returns DONE: shell_run()
+ * steps it instead of reading input, so typeahead stays queued and
+ * linebuf (which argv points into) stays untouched. The queue is only
+ * scanned for Ctrl+C.
+ * =========================== */
+#if SHELL_ENABLE_METRICS
+static uint32_t mt_clock(shell_t *sh)
+{
+    return sh->metrics_clock ? sh->metrics_clock() : 0;
+}
+
+/* Id of cmd in cs, or cs->cmd_count if it isn't one of cs's entries */
+static uint16_t cs_cmd_id(const shell_cmdset_t *cs, const shell_ext_cmd_t *cmd)
+{
+#if SHELL_FEATURE_SPANS
+    if (cs->spans) {
+        for (uint8_t i = 0; i < cs->span_count; i++) {
+            const shell_cmd_span_t *s = &cs->spans[i];
+            if (cmd >= s->table && cmd < s->table + s->count)
+                return (uint16_t)(cs->span_base[i] + (cmd - s->table));
+        }
+        return cs->cmd_count;
+    }
+#endif
+    if (!cs->cmd_table || cmd < cs->cmd_table || cmd >= cs->cmd_table + cs->cmd_count)
+        return cs->cmd_count;
+    return (uint16_t)(cmd - cs->cmd_table);
+}
+
+/* cmd ran (calls = 1) or took one more step (calls = 0) since t0 */
+static void mt_cmd(shell_t *sh, const shell_ext_cmd_t *cmd, uint32_t t0, uint32_t calls)
+{
+    uint32_t dt = mt_clock(sh) - t0;
+    const shell_cmdset_t *cs = sh->cmdset;
+
+    if (!cs)
+        return;
+    uint16_t i = cs_cmd_id(cs, cmd);
+    if (i >= cs->cmd_count || i >= SHELL_METRICS_MAX_CMDS)
+        return; /* The table was swapped under it */
+
+    shell_cmd_metrics_t *m = &sh->cmd_metrics[i];
+    m->calls += calls;
+    m->total_ticks += dt;
+    if (dt > m->max_ticks) m->max_ticks = dt;
+}
+#else
+#define mt_clock(sh)                0u
+#define mt_cmd(sh, cmd, t0, calls)  ((void)(t0))
+#endif
+
+static void job_start(shell_t *sh, const shell_ext_cmd_t *cmd, int argc, char **argv,
+                      const shell_args_t *args)
+{
+    memcpy(sh->job_argv, argv, (size_t)(argc + 1) * sizeof argv[0]);
+#if SHELL_FEATURE_ARGS
+    sh->job.args      = NULL;
+    if (cmd->args) {
+        sh->job_args      = *args;
+        sh->job_args.argv = sh->job_argv;
+        sh->job.args      = &sh->job_args;
+    }
+#else
+    (void)args;
+#endif
+    sh->job.argc      = argc;
+    sh->job.argv      = sh->job_argv;
+    sh->job.user_data = cmd->user_data;
+    sh->job.calls     = 0;
+    sh->job.state     = 0;
+    sh->job.cancel    = false;
+    sh->job.sh        = sh;
+    sh->job.status    = 0;
+    sh->job_cmd       = cmd;
+}
+
+static void job_cancel(shell_t *sh)
+{
+    if (!sh->job.cancel) {
+        sh->job.cancel = true;
+        sh_puts(sh, "^C\r\n");
+    }
+}
+
+/* Ctrl+C anywhere in the queue cancels; input up to it is dropped. With
+ * getc_f one byte is polled per call as well: Ctrl+C cancels, anything
+ * else is held for when the command is done. The queue belongs to the
+ * producer's side, so a polled byte is never pushed into it. */
+static void job_poll_cancel(shell_t *sh)
+{
+    uint16_t head = sh_load_acquire(&sh->in_head);
+
+    for (uint16_t i = sh->in_tail; i != head; i = (uint16_t)((i + 1) & SH_QMASK)) {
+        if (sh->in_q[i] == 3) {
+            sh_store_release(&sh->in_tail, (uint16_t)((i + 1) & SH_QMASK));
+            job_cancel(sh);
+            return;
+        }
+    }
+
+    if (sh->getc_f) {
+        int ch = sh->getc_f();
+        if (ch == 3) {
+            /* Bytes that came in since the scan are older than this ^C */
+            sh_store_release(&sh->in_tail, sh_load_acquire(&sh->in_head));
+            sh->getc_held = false;
+            job_cancel(sh);
+        } else if (ch >= 0 && !sh->getc_held) {
+            sh->getc_held = true;
+            sh->getc_byte = (uint8_t)ch;
+        } else if (ch >= 0) {
+            MT_ADD(sh, in_q_drops, 1);
+        }
+    }
+}
+
+/* A batch line has no shell_run() to come back to, so its resumable
+ * command is stepped to the end here; Ctrl+C still reaches it. */
+static void job_finish(shell_t *sh)
+{
+    shell_step_t r;
+
+    do {
+        job_poll_cancel(sh);
+        uint32_t t0 = mt_clock(sh);
+        sh_callout_begin(sh);
+        r = sh->job_cmd->step(&sh->job);
+        sh_callout_end(sh);
+        mt_cmd(sh, sh->job_cmd, t0, sh->job.calls == 0);
+        sh->job.calls++;
+    } while (r != SHELL_STEP_DONE);
+    sh->job_cmd = NULL;
+    sh->last_status = sh->job.status;
+}
+
+/* ===========================
+ * Command groups
+ *
+ * A group entry hands the next word to its own set, so "gpio set 3 1"
+ * resolves gpio in the root set and set in gpio's, each through its
+ * own trie. The handler sees the words from its own name on.
+ * =========================== */
+#if SHELL_FEATURE_GROUPS
+static bool cmd_has_handler(const shell_ext_cmd_t *cmd)
+{
+#if SHELL_FEATURE_ARGS
+    if (cmd->typed) return true;
+#endif
+    return cmd->fn || cmd->run || cmd->step;
+}
+
+/* Descend while the next word names a subcommand, advancing *argc and
+ * *argv past each group word. Returns the command to run. */
+static const shell_ext_cmd_t *group_resolve(const shell_t *sh, const shell_ext_cmd_t *cmd,
+                                            int *argc, char ***argv)
+{
+    while (cmd->sub && *argc > 1) {
+        const shell_ext_cmd_t *sub = sh_resolve(sh, cmd->sub, (*argv)[1]);
+        if (!sub) break;
+        cmd = sub;
+        (*argv)++;
+        (*argc)--;
+    }
+    return cmd;
+}
+
+/* A group that can't run by itself: say why and list its set */
+static int group_usage(shell_t *sh, const shell_ext_cmd_t *cmd,
+                       int argc, char **argv, bool verbose)
+{
+    if (verbose) {
+        if (argc > 1) {
+            sh_puts(sh, cmd->name);
+            sh_puts(sh, ": no subcommand '");
+            sh_puts(sh, argv[1]);
+            sh_puts(sh, "'\r\n");
+            sh_suggest(sh, cmd->sub, argv[1]);
+        }
+        sh_puts(sh, "usage: ");
+        sh_puts(sh, cmd->name);
+        sh_putc(sh, ' ');
+        for (uint16_t i = 0; cmd->sub->cmd_table && i < cmd->sub->cmd_count; i++) {
+            if (i) sh_putc(sh, '|');
+            sh_puts(sh, cs_cmd(cmd->sub, i)->name);
+        }
+        sh_puts(sh, "\r\n");
+    }
+    return argc > 1 ? SHELL_EXIT_NOT_FOUND : SHELL_EXIT_USAGE;
+}
+
+#define group_is_stub(cmd) ((cmd)->sub && !cmd_has_handler(cmd))
+#else
+#define group_is_stub(cmd) false
+#define group_usage(sh, cmd, argc, argv, verbose) 0
+#endif
+
+/* ===========================
+ * Command chains
+ *
+ * build_argv() hands back one command and the operator after it;
+ * chain_run() decides from the operator and $? whether the next one
+ * runs. A step command parks the rest of the chain in chain_next
+ * (inside linebuf, which the job leaves alone) until it is done.
+ * =========================== */
+/* last_status in decimal, without stdio; status_str fits any 32-bit int */
+static char *sh_status_text(shell_t *sh)
+{
+    char *p = &sh->status_str[sizeof sh->status_str - 1];
+    int st = sh->last_status;
+    unsigned int n = st < 0 ? 0u - (unsigned int)st : (unsigned int)st;
+
+    *p = '\0';
+    do {
+        *--p = (char)('0' + (n % 10));
+        n /= 10;
+    } while (n > 0);
+    if (st < 0)
+        *--p = '-';
+    return p;
+}
+
+/* An argument of exactly "$?" becomes the status so far */
+static void sh_expand_status(shell_t *sh, char **argv, int argc)
+{
+    char *text = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "$?") != 0) continue;
+        if (!text)
+            text = sh_status_text(sh);
+        argv[i] = text;
+    }
+}
+
+/* Run the chain at line, op being the operator in front of it. With
+ * finish set (batch), step commands run to the end in place; otherwise
+ * the first one stops the walk with sh->job_cmd set. Returns how many
+ * commands ran. */
+static int chain_run(shell_t *sh, char *line, char op, bool finish)
+{
+    char *words[SHELL_MAX_ARGS + 1];
+    shell_args_t args;
+    int ran = 0;
+    bool verbose = !finish || SH_CAPTURING(sh); /* Batch runs are quiet */
+
+    sh->chain_next = NULL;
+    while (line) {
+        char *next;
+        char next_op;
+        char **argv = words;
+        int argc = build_argv(line, words, SHELL_MAX_ARGS, &next, &next_op);
+        bool run = (op == '&') ? sh->last_status == 0
+                 : (op == '|') ? sh->last_status != 0
+                 : true;
+        line = next;
+        op = next_op;
+        if (!run || argc == 0)
+            continue;
+
+        ran++;
+        sh_expand_status(sh, argv, argc);
+        const shell_ext_cmd_t *cmd = sh_find_cmd(sh, argv[0]);
+#if SHELL_FEATURE_GROUPS
+        if (cmd && cmd->sub)
+            cmd = group_resolve(sh, cmd, &argc, &argv);
+#endif
+        if (!cmd) {
+            if (verbose) {
+                sh_puts(sh, "Command not found\r\n");
+                sh_suggest(sh, sh->cmdset, argv[0]);
+            }
+            sh->last_status = SHELL_EXIT_NOT_FOUND;
+        } else if (group_is_stub(cmd)) {
+            sh->last_status = group_usage(sh, cmd, argc, argv, verbose);
+        } else if (!args_parse(sh, cmd, argc, argv, &args, verbose)) {
+            sh->last_status = SHELL_EXIT_USAGE;
+        } else if (cmd->step) {
+            job_start(sh, cmd, argc, argv, &args);
+            if (!finish) {
+                sh->chain_next = line; /* shell_run() takes it from here */
+                sh->chain_op = op;
+                return ran;
+            }
+            job_finish(sh);
+            if (sh->job.cancel)
+                break; /* ^C drops the rest of the line */
+        } else {
+            /* Handlers typically print through their own channel */
+            int status = 0;
+            uint32_t t0 = mt_clock(sh);
+            sh_callout_begin(sh);
+#if SHELL_FEATURE_ARGS
+            if (cmd->typed)
+                status = cmd->typed(&args, cmd->user_data);
+            else
+#endif
+            if (cmd->run)
+                status = cmd->run(argc, argv, cmd->user_data);
+            else if (cmd->fn)
+                cmd->fn(argc, argv, cmd->user_data);
+            sh_callout_end(sh);
+            mt_cmd(sh, cmd, t0, 1);
+            sh->last_status = status;
+        }
+    }
+    return ran;
+}
+
+/* The whole line is through: let the host see $? */
+static void chain_done(shell_t *sh)
+{
+    if (!sh->status_hook) return;
+    sh_callout_begin(sh);
+    sh->status_hook(sh, sh->last_status, sh->status_ctx);
+    sh_callout_end(sh);
+}
+
+/* Step the running command for one slice; the prompt returns when done */
+static void job_run(shell_t *sh)
+{
+    uint32_t start = sh->clock_f ? sh->clock_f() : 0;
+    uint16_t steps = 0;
+
+    for (;;) {
+        uint32_t t0 = mt_clock(sh);
+        sh_callout_begin(sh);
+        shell_step_t r = sh->job_cmd->step(&sh->job);
+        sh_callout_end(sh);
+        mt_cmd(sh, sh->job_cmd, t0, sh->job.calls == 0);
+        sh->job.calls++;
+
+        if (r == SHELL_STEP_DONE) {
+            sh->job_cmd = NULL;
+            sh->last_status = sh->job.status;
+            if (sh->chain_next && !sh->job.cancel) {
+                chain_run(sh, sh->chain_next, sh->chain_op, false);
+                if (sh->job_cmd)
+                    return; /* The chain went resumable again */
+            }
+            chain_done(sh);
+            reset_line(sh);
+            sh_prompt(sh);
+            return;
+        }
+        if (sh->clock_f) {
+            if ((uint32_t)(sh->clock_f() - start) >= sh->job_slice)
+                return;
+        } else if (++steps >= SHELL_JOB_STEPS) {
+            return;
+        }
+    }
+}
+
+static void exec_line(shell_t *sh)
+{
+    sh_render_leave(sh);
+    sh_putc(sh, '\r'); sh_putc(sh, '\n');
+
+    if (sh->line_len == 0) {
+        sh_prompt(sh);
+        return;
+    }
+
+    /* History takes its copy before build_argv splits the line */
+    sh->linebuf[sh->line_len] = '\0';
+#if SHELL_FEATURE_HISTORY
+    sh_add_history(sh, sh->linebuf);
+#endif
+
+    /* Tokenize in place; reset_line() follows, so linebuf is ours to cut */
+    if (chain_run(sh, sh->linebuf, ';', false) == 0) {
+        sh_prompt(sh);
+        return;
+    }
+    if (sh->job_cmd)
+        return;
+
+    chain_done(sh);
+    sh_prompt(sh);
+}
+
+/* ===========================
+ * Batch / script execution
+ *
+ * Lines run straight through build_argv() and dispatch: no escape
+ * parsing, echo, redraw, prompt or history.
+ * =========================== */
+static const char *batch_strerror(shell_status_t st)
+{
+    switch (st) {
+    case SHELL_ERR_NOT_FOUND: return "Command not found";
+    case SHELL_ERR_NO_SPACE:  return "Line too long";
+    case SHELL_ERR_FAILED:    return "Failed";
+    default:                  return "Error";
+    }
+}
+
+/* Blank lines and # comments are skipped */
+static bool line_is_blank(const char *p)
+{
+    while (isspace((unsigned char)*p)) p++;
+    return *p == '\0' || *p == '#';
+}
+
+/* Run one NUL-terminated line (cut in place) to the end */
+static shell_status_t run_line(shell_t *sh, char *line)
+{
+    chain_run(sh, line, ';', true);
+    chain_done(sh);
+    if (sh->last_status == SHELL_EXIT_NOT_FOUND)
+        return SHELL_ERR_NOT_FOUND;
+    return sh->last_status != 0 ? SHELL_ERR_FAILED : SHELL_OK;
+}
+
+/* Run one batch line and report its status */
+static shell_status_t batch_line(shell_t *sh, uint16_t line_no, char *line,
+                                 bool too_long)
+{
+    shell_status_t st;
+
+    if (too_long)
+        st = SHELL_ERR_NO_SPACE;
+    else if (line_is_blank(line))
+        return SHELL_OK;
+    else
+        st = run_line(sh, line);
+
+    if (sh->script_report) {
+        sh_callout_begin(sh);
+        sh->script_report(line_no, st, sh->script_ctx);
+        sh_callout_end(sh);
+    } else if (st != SHELL_OK) {
+        sh_puts_uint(sh, line_no);
+        sh_puts(sh, ": ");
+        sh_puts(sh, batch_strerror(st));
+        sh_puts(sh, "\r\n");
+    }
+    return st;
+}
+
+/* Batch mode input: collect a line, run it on CR or LF */
+static void batch_char(shell_t *sh, int ch)
+{
+    if (ch == '\n' && sh->batch_cr) {
+        sh->batch_cr = false;
+        return;
+    }
+    sh->batch_cr = (ch == '\r');
+
+    if (ch == '\r' || ch == '\n') {
+        sh->linebuf[sh->line_len] = '\0';
+        batch_line(sh, ++sh->batch_line, sh->linebuf, sh->batch_overflow);
+        sh->batch_overflow = false;
+        reset_line(sh);
+        return;
+    }
+
+    if (sh->line_len < SHELL_LINEBUF_SIZE - 1)
+        sh->linebuf[sh->line_len++] = (char)ch;
+    else
+        sh->batch_overflow = true;
+}
+
+static void sh_clear_screen(shell_t *sh)
+{
+    sh_puts(sh, ANSI_CLEAR_SCREEN);
+    sh_puts(sh, ANSI_MOVE_CURSOR_HOME);
+    sh->term_cursor = 0; /* Nothing above the cursor any more */
+    sh_redraw_line(sh);
+}
+
+void shell_clear_screen(shell_t *sh)
+{
+    sh_clear_screen(sh);
+    sh_flush(sh);
+}
+
+static void sh_insert_text(shell_t *sh, const char *text)
+{
+    size_t len = strlen(text);
+    if (sh->line_len + len >= SHELL_LINEBUF_SIZE) {
+        len = SHELL_LINEBUF_SIZE - 1 - sh->line_len;
+    }
+    if (len == 0) return;
+    
+    /* Make space */
+    memmove(&sh->linebuf[sh->cursor_pos + len],
+            &sh->linebuf[sh->cursor_pos],
+            sh->line_len - sh->cursor_pos);
+    
+    /* Insert */
+    memcpy(&sh->linebuf[sh->cursor_pos], text, len);
+    
+    uint16_t pos = sh->cursor_pos;
+    sh->line_len += (uint16_t)len;
+    sh->cursor_pos += (uint16_t)len;
+    sh->linebuf[sh->line_len] = '\0';
+    
+    sh_render_insert(sh, pos, (uint16_t)len);
+}
+
+void shell_insert_text(shell_t *sh, const char *text)
+{
+    sh_insert_text(sh, text);
+    sh_flush(sh);
+}
+
+static void sh_redraw_line(shell_t *sh)
+{
+    MT_ADD(sh, redraws, 1);
+    sh_goto(sh, sh->prompt_len + sh->term_cursor, 0); // Go to start of line
+    // Clear to end of line, and the rows it wrapped onto
+    sh_puts(sh, sh_cols(sh) ? ANSI_CLEAR_BELOW : ANSI_CLEAR_LINE_FROM_CURSOR);
+    sh_prompt(sh); // Prints "> " and sets prompt_len
+    sh_emit(sh, 0, sh->line_len);
+    sh->term_len = sh->line_len;
+
+    // Now move cursor back to correct position
+    sh_move_cursor(sh, sh->cursor_pos);
+}
+
+void shell_redraw_line(shell_t *sh)
+{
+    sh_redraw_line(sh);
+    sh_flush(sh);
+}
+
+void shell_set_term_width(shell_t *sh, uint16_t cols)
+{
+#if SHELL_FEATURE_WRAP
+    if (!sh) return;
+    sh_lock(sh);
+    sh->term_cols  = cols;
+    sh->term_query = false;
+    sh_unlock(sh);
+#else
+    (void)sh; (void)cols;
+#endif
+}
+
+uint16_t shell_get_term_width(const shell_t *sh)
+{
+    return sh ? (uint16_t)SH_TERM_COLS(sh) : 0;
+}
+
+void shell_query_term_width(shell_t *sh)
+{
+#if SHELL_FEATURE_WRAP
+    if (!sh) return;
+    sh_lock(sh);
+    sh_puts(sh, ANSI_QUERY_WIDTH);
+    sh->term_query = true;
+    sh_flush(sh);
+    sh_unlock(sh);
+#else
+    (void)sh;
+#endif
+}
+
+const char *shell_get_line(shell_t *sh)
+{
+    return sh->linebuf;
+}
+
+#if SHELL_FEATURE_COMPLETION
+/* One name of a candidate listing, in columns of col_width */
+static void sh_complete_item(shell_t *sh, const char *name, int col_width,
+                             int num_cols, int *col)
+{
+    size_t name_len = strlen(name);
+    sh_write(sh, name, name_len);
+
+    // Add padding
+    for (int p = (int)name_len; p < col_width; p++) {
+        sh_putc(sh, ' ');
+    }
+
+    if (++*col >= num_cols) {
+        sh_putc(sh, '\r'); sh_putc(sh, '\n');
+        *col = 0;
+    }
 }
 
-/* ===========================
- * Escape parsing
- * =========================== */
-static void esc_reset(shell_esc_t *e)
+static void sh_complete_end(shell_t *sh, int col)
 {
-    e->state = 0;
-    e->num_params = 0;
-    for (int i = 0; i < 4; i++) e->params[i] = 0;
+    if (col > 0) {
+        sh_putc(sh, '\r'); sh_putc(sh, '\n');
+    }
+
+    // Redraw prompt and line on the fresh row
+    sh->term_cursor = 0;
+    sh_redraw_line(sh);
 }
 
-static shell_key_t esc_finish_csi(shell_esc_t *e, char final)
-{
-    switch (final) {
-    case 'A': return SHELL_KEY_UP;
-    case 'B': return SHELL_KEY_DOWN;
-    case 'C': return SHELL_KEY_RIGHT;
-    case 'D': return SHELL_KEY_LEFT;
-    case 'H': return SHELL_KEY_HOME;
-    case 'F': return SHELL_KEY_END;
-    case 'Z': return SHELL_KEY_TAB; /* Shift+Tab, treat as Tab */
-    case '~':
-        if (e->num_params == 0) return SHELL_KEY_NONE;
-        switch (e->params[0]) {
-        case 1:  return SHELL_KEY_HOME;
-        case 2:  return SHELL_KEY_INS;
-        case 3:  return SHELL_KEY_DEL;
-        case 4:  return SHELL_KEY_END;
-        case 5:  return SHELL_KEY_PGUP;
-        case 6:  return SHELL_KEY_PGDN;
-        case 15: return SHELL_KEY_F5;
-        case 17: return SHELL_KEY_F6;
-        case 18: return SHELL_KEY_F7;
-        case 19: return SHELL_KEY_F8;
-        case 20: return SHELL_KEY_F9;
-        case 21: return SHELL_KEY_F10;
-        case 23: return SHELL_KEY_F11;
-        case 24: return SHELL_KEY_F12;
-        default: return SHELL_KEY_NONE;
-        }
-    default:
-        return SHELL_KEY_NONE;
+/* Put the completion in: a unique match gets its trailing space, several
+ * get their common extension, or the list when there is nothing to add */
+static bool sh_complete_apply(shell_t *sh, const char *rep, size_t len,
+                              size_t end, uint16_t match_count)
+{
+    if (end > SHELL_LINEBUF_SIZE - 2) end = SHELL_LINEBUF_SIZE - 2;
+
+    char ext[SHELL_LINEBUF_SIZE];
+    size_t ext_len = end > len ? end - len : 0;
+    memcpy(ext, rep + len, ext_len);
+    ext[ext_len] = '\0';
+
+    if (match_count == 1) {
+        // Single match - complete it with a space
+        sh_insert_text(sh, ext);
+        sh_insert_text(sh, " ");
+    } else if (ext_len > 0) {
+        // Insert common prefix
+        sh_insert_text(sh, ext);
+    } else {
+        return false; /* Caller shows all matches */
     }
+    return true;
 }
 
-static sh_parse_result_t esc_parse(shell_t *sh, int ch, shell_key_t *out_key)
+#if SHELL_FEATURE_ARGS
+/* Walk the schema candidates for the word being typed: unused flags,
+ * then the choices of the ENUM at this position. *k starts at 0. */
+static const char *args_candidate(const shell_ext_cmd_t *cmd, const shell_arg_spec_t *spec,
+                                  uint32_t used, uint16_t *k)
 {
-    shell_esc_t *e = &sh->esc;
-    *out_key = SHELL_KEY_NONE;
+    uint8_t n = args_count(cmd);
 
-    if (e->state == 0) {
-        if (ch == 0x1B) {
-            e->state = 1;
-            return SH_PARSE_CONTINUE;
-        }
-        return SH_PARSE_NONE;
+    while (*k < n) {
+        uint16_t i = (*k)++;
+        if (cmd->args[i].type == SHELL_ARG_FLAG && !((used >> i) & 1u))
+            return cmd->args[i].name;
     }
+    if (spec && spec->type == SHELL_ARG_ENUM && spec->choices && spec->choices[*k - n])
+        return spec->choices[(*k)++ - n];
+    return NULL;
+}
 
-    if (e->state == 1) {
-        if (ch == '[') {
-            e->state = 2;
-            e->num_params = 0;
-            return SH_PARSE_CONTINUE;
-        } else if (ch == 'O') {
-            e->state = 3;
-            return SH_PARSE_CONTINUE;
-        } else {
-            esc_reset(e);
-            return SH_PARSE_NONE;
-        }
+/* Complete part (len chars) as an argument of cmd, whose finished words
+ * are argv[1..argc). Returns false to beep. */
+static bool sh_complete_args(shell_t *sh, const shell_ext_cmd_t *cmd, int argc, char **argv,
+                             const char *part, size_t len)
+{
+    if (!cmd->args)
+        return false;
+
+    uint32_t used = 0;
+    uint8_t pos = 0;
+    for (int w = 1; w < argc; w++) {
+        int f = args_flag(cmd, argv[w]);
+        if (f >= 0)
+            used |= 1u << f;
+        else
+            pos = (uint8_t)(args_next_pos(cmd, pos) + 1);
     }
+    pos = args_next_pos(cmd, pos);
+    const shell_arg_spec_t *spec = pos < args_count(cmd) ? &cmd->args[pos] : NULL;
 
-    if (e->state == 2) {
-        if (ch >= '0' && ch <= '9') {
-            if (e->num_params == 0) {
-                e->num_params = 1;
-                e->params[0] = 0;
-            }
-            e->params[e->num_params - 1] =
-                (uint16_t)(e->params[e->num_params - 1] * 10 + (ch - '0'));
-            return SH_PARSE_CONTINUE;
-        } else if (ch == ';') {
-            if (e->num_params < 4) {
-                e->params[e->num_params++] = 0;
-            }
-            return SH_PARSE_CONTINUE;
+    /* Candidates extend the typed word, like command names */
+    const char *rep = NULL, *c;
+    size_t end = 0, max_len = 0;
+    uint16_t match_count = 0, k = 0;
+    while ((c = args_candidate(cmd, spec, used, &k)) != NULL) {
+        if (strncmp(c, part, len) != 0 || c[len] == '\0')
+            continue;
+        size_t c_len = strlen(c);
+        if (match_count++ == 0) {
+            rep = c;
+            end = c_len;
         } else {
-            *out_key = esc_finish_csi(e, (char)ch);
-            esc_reset(e);
-            return SH_PARSE_COMPLETE;
+            size_t i = len;
+            while (i < end && c[i] == rep[i])
+                i++;
+            end = i;
         }
+        if (c_len > max_len) max_len = c_len;
     }
+    if (match_count == 0)
+        return false;
+    if (sh_complete_apply(sh, rep, len, end, match_count))
+        return true;
 
-    if (e->state == 3) {
-        switch (ch) {
-        case 'P': *out_key = SHELL_KEY_F1; break;
-        case 'Q': *out_key = SHELL_KEY_F2; break;
-        case 'R': *out_key = SHELL_KEY_F3; break;
-        case 'S': *out_key = SHELL_KEY_F4; break;
-        case 'H': *out_key = SHELL_KEY_HOME; break;
-        case 'F': *out_key = SHELL_KEY_END; break;
-        default:  *out_key = SHELL_KEY_NONE; break;
-        }
-        esc_reset(e);
-        return SH_PARSE_COMPLETE;
-    }
+    /* Show all matches */
+    sh_putc(sh, '\r'); sh_putc(sh, '\n');
+    const int cols = SH_TERM_COLS(sh) ? (int)SH_TERM_COLS(sh) : 80;
+    int col_width = (int)max_len + 2;
+    int num_cols = cols / col_width;
+    if (num_cols < 1) num_cols = 1;
 
-    esc_reset(e);
-    return SH_PARSE_NONE;
+    int col = 0;
+    k = 0;
+    while ((c = args_candidate(cmd, spec, used, &k)) != NULL) {
+        if (strncmp(c, part, len) == 0 && c[len] != '\0')
+            sh_complete_item(sh, c, col_width, num_cols, &col);
+    }
+    sh_complete_end(sh, col);
+    return true;
 }
+#endif
 
+#if SHELL_FEATURE_ART
 /* ===========================
- * History management
+ * Tab completion (trie walk)
+ *
+ * Candidates are the commands strictly below the node for the typed
+ * prefix, so a Tab costs O(prefix + results) regardless of table size.
  * =========================== */
-void shell_add_history(shell_t *sh, const char *line)
+static void art_complete_list(shell_t *sh, const shell_cmdset_t *cs, uint16_t top)
 {
-    if (!line || !*line) return;
-
-    /* Don't add duplicate of last command */
-    if (sh->history_count > 0) {
-        uint8_t last = (sh->history_head + SHELL_HISTORY_SIZE - 1) % SHELL_HISTORY_SIZE;
-        if (strcmp(sh->history[last].line, line) == 0)
-            return;
-    }
+    sh_putc(sh, '\r'); sh_putc(sh, '\n');
 
-    strncpy(sh->history[sh->history_head].line, line, SHELL_LINEBUF_SIZE - 1);
-    sh->history[sh->history_head].line[SHELL_LINEBUF_SIZE - 1] = '\0';
+    const int cols = SH_TERM_COLS(sh) ? (int)SH_TERM_COLS(sh) : 80;
+    int col_width = cs->art[top + ART_H_MAXLEN] + 2;
+    int num_cols = cols / col_width;
+    if (num_cols < 1) num_cols = 1;
 
-    sh->history_head = (sh->history_head + 1) % SHELL_HISTORY_SIZE;
-    if (sh->history_count < SHELL_HISTORY_SIZE)
-        sh->history_count++;
+    // Display matches in columns
+    int col = 0;
+    art_iter_t it;
+    art_iter_init(&it, top);
+    for (uint16_t ci = art_iter_next(cs, &it); ci != ART_NIL; ci = art_iter_next(cs, &it))
+        sh_complete_item(sh, art_cmd_name(cs, ci), col_width, num_cols, &col);
+    sh_complete_end(sh, col);
 }
 
-static void history_prev(shell_t *sh)
+static bool art_complete_name(shell_t *sh, const shell_cmdset_t *cs,
+                              const char *part, size_t len)
 {
-    if (sh->history_count == 0) return;
+    uint16_t top = cs->cmd_table ? art_walk(cs, part, len) : ART_NIL;
+    if (top == ART_NIL)
+        return false;
 
-    if (sh->history_pos == -1) {
-        /* Save current line before browsing */
-        strncpy(sh->history_saved, sh->linebuf, SHELL_LINEBUF_SIZE);
-        sh->history_pos = (sh->history_head + SHELL_HISTORY_SIZE - 1) % SHELL_HISTORY_SIZE;
+    /* An exact match of the typed text is not a candidate */
+    uint16_t match_count;
+    if (ART_IS_LEAF(top)) {
+        match_count = strlen(art_cmd_name(cs, ART_LEAF_CMD(top))) > len;
     } else {
-        int next_pos = (sh->history_pos + SHELL_HISTORY_SIZE - 1) % SHELL_HISTORY_SIZE;
-        int oldest = (sh->history_head + SHELL_HISTORY_SIZE - sh->history_count) % SHELL_HISTORY_SIZE;
-        
-        if (sh->history_count == SHELL_HISTORY_SIZE) {
-            if (next_pos == oldest) return;
-        } else {
-            if (next_pos < 0 || next_pos < oldest) return;
-        }
-        sh->history_pos = next_pos;
+        bool exact = art_cmd(cs, top) != ART_NIL && cs->art[top + ART_H_DEPTH] == len;
+        match_count = (uint16_t)(art_rd16(cs->art + top + ART_H_NCMDS) - exact);
     }
 
-    strncpy(sh->linebuf, sh->history[sh->history_pos].line, SHELL_LINEBUF_SIZE);
-    sh->line_len = (uint16_t)strlen(sh->linebuf);
-    sh->cursor_pos = sh->line_len;
-    shell_redraw_line(sh);
-}
-
-static void history_next(shell_t *sh)
-{
-    if (sh->history_pos == -1) return;
+    if (match_count == 0)
+        return false; // No matches - beep
 
-    int next_pos = (sh->history_pos + 1) % SHELL_HISTORY_SIZE;
-    
-    if (next_pos == sh->history_head) {
-        /* Restore saved line */
-        sh->history_pos = -1;
-        strncpy(sh->linebuf, sh->history_saved, SHELL_LINEBUF_SIZE);
-    } else {
-        sh->history_pos = next_pos;
-        strncpy(sh->linebuf, sh->history[sh->history_pos].line, SHELL_LINEBUF_SIZE);
+    /* Longest common prefix: runs down to the first node where the
+     * candidates branch, or where one of them ends */
+    uint16_t cur = top;
+    while (!ART_IS_LEAF(cur) && cs->art[cur + ART_H_COUNT] == 1 &&
+           (cs->art[cur + ART_H_DEPTH] == len || art_cmd(cs, cur) == ART_NIL)) {
+        uint16_t pos = 0;
+        uint8_t key;
+        cur = art_child_next(cs, cur, &pos, &key);
     }
 
-    sh->line_len = (uint16_t)strlen(sh->linebuf);
-    sh->cursor_pos = sh->line_len;
-    shell_redraw_line(sh);
+    const char *rep = art_cmd_name(cs, art_rep_cmd(cs, cur));
+    size_t end = ART_IS_LEAF(cur) ? strlen(rep) : cs->art[cur + ART_H_DEPTH];
+    if (!sh_complete_apply(sh, rep, len, end, match_count))
+        art_complete_list(sh, cs, top); // Show all matches
+    return true;
 }
+#endif /* SHELL_FEATURE_ART */
 
 /* ===========================
- * Login
+ * Tab completion (table scan)
+ *
+ * Without the trie, candidates are the names that extend the typed
+ * prefix. In a sorted table they are one run found by binary search,
+ * otherwise every Tab is one pass over the table.
  * =========================== */
-static void login_reset(shell_t *sh)
+static bool lin_candidate(const shell_cmdset_t *cs, uint16_t i,
+                          const char *s, size_t len)
 {
-    sh->login_state = 0;
-    sh->login_idx   = 0;
-    memset(sh->login_user, 0, sizeof sh->login_user);
-    memset(sh->login_pass, 0, sizeof sh->login_pass);
+    const char *name = cs_cmd(cs, i)->name;
+    return name && strncmp(name, s, len) == 0 && name[len] != '\0';
 }
 
-static void login_prompt_user(shell_t *sh)
+static void tbl_complete_list(shell_t *sh, const shell_cmdset_t *cs,
+                              const char *part, size_t len, int max_len)
 {
-    sh_puts(sh, "login: ");
-    sh->login_idx = 0;
-}
+    sh_putc(sh, '\r'); sh_putc(sh, '\n');
 
-static void login_prompt_pass(shell_t *sh)
-{
-    sh_puts(sh, "password: ");
-    sh->login_idx = 0;
+    const int cols = SH_TERM_COLS(sh) ? (int)SH_TERM_COLS(sh) : 80;
+    int col_width = max_len + 2;
+    int num_cols = cols / col_width;
+    if (num_cols < 1) num_cols = 1;
+
+    int col = 0;
+    uint16_t lo, hi;
+    tbl_range(cs, part, len, &lo, &hi);
+    for (uint16_t i = lo; i < hi; i++) {
+        if (lin_candidate(cs, i, part, len))
+            sh_complete_item(sh, cs_cmd(cs, i)->name, col_width, num_cols, &col);
+    }
+    sh_complete_end(sh, col);
 }
 
-static void handle_login(shell_t *sh, int ch)
+static bool tbl_complete_name(shell_t *sh, const shell_cmdset_t *cs,
+                              const char *part, size_t len)
 {
-    switch (sh->login_state) {
-    case 0:
-        if (ch == (unsigned char)sh->login_trigger) {
-            sh->login_state = 1;
-            login_prompt_user(sh);
-        }
-        break;
-    case 1: /* username */
-        if (ch == '\r' || ch == '\n') {
-            sh_putc(sh, '\r'); sh_putc(sh, '\n');
-            sh->login_user[sh->login_idx] = 0;
-            sh->login_state = 2;
-            login_prompt_pass(sh);
-        } else if (ch == 0x7F || ch == '\b') {
-            if (sh->login_idx) {
-                sh->login_idx--;
-                sh_putc(sh, '\b'); sh_putc(sh, ' '); sh_putc(sh, '\b');
-            }
-        } else if (sh->login_idx < sizeof sh->login_user - 1) {
-            sh->login_user[sh->login_idx++] = (char)ch;
-            sh_putc(sh, (char)ch);
-        }
-        break;
-    case 2: /* password */
-        if (ch == '\r' || ch == '\n') {
-            sh_putc(sh, '\r'); sh_putc(sh, '\n');
-            sh->login_pass[sh->login_idx] = 0;
-            bool ok = false;
-            if (sh->login_cb)
-                ok = sh->login_cb(sh->login_user, sh->login_pass);
-            if (ok) {
-                sh->logged_in = true;
-                login_reset(sh);
-                sh_prompt(sh);
-            } else {
-                sh_puts(sh, "Login failed\r\n");
-                login_reset(sh);
-            }
-        } else if (ch == 0x7F || ch == '\b') {
-            if (sh->login_idx) {
-                sh->login_idx--;
-            }
-        } else if (sh->login_idx < sizeof sh->login_pass - 1) {
-            sh->login_pass[sh->login_idx++] = (char)ch;
+    const char *rep = NULL;
+    size_t end = 0, max_len = 0;
+    uint16_t match_count = 0;
+    uint16_t lo = 0, hi = 0;
+
+    if (cs->cmd_table)
+        tbl_range(cs, part, len, &lo, &hi);
+    for (uint16_t i = lo; i < hi; i++) {
+        if (!lin_candidate(cs, i, part, len))
+            continue;
+        const char *name = cs_cmd(cs, i)->name;
+        size_t name_len = strlen(name);
+        if (match_count++ == 0) {
+            rep = name;
+            end = name_len;
+        } else {
+            size_t k = len;
+            while (k < end && name[k] == rep[k])
+                k++;
+            end = k;
         }
-        break;
+        if (name_len > max_len) max_len = name_len;
     }
+
+    if (match_count == 0)
+        return false; // No matches - beep
+
+    if (!sh_complete_apply(sh, rep, len, end, match_count))
+        tbl_complete_list(sh, cs, part, len, (int)max_len); // Show all matches
+    return true;
 }
 
-/* ===========================
- * Line editor + exec
- * =========================== */
-static void reset_line(shell_t *sh)
+/* Complete part (len chars) as a name in cs. Returns false to beep. */
+static bool sh_complete_name(shell_t *sh, const shell_cmdset_t *cs,
+                             const char *part, size_t len)
 {
-    sh->line_len   = 0;
-    sh->cursor_pos = 0;
-    sh->history_pos = -1;
-    memset(sh->linebuf, 0, sizeof sh->linebuf);
+    if (!cs)
+        return false;
+#if SHELL_FEATURE_ART
+    if (cs->art)
+        return art_complete_name(sh, cs, part, len);
+#endif
+    return tbl_complete_name(sh, cs, part, len);
 }
 
-static void exec_line(shell_t *sh)
+/* The word at the cursor is a name while every word before it named a
+ * group (or there are none), else an argument of the last command.
+ * Returns false to beep. */
+static bool sh_complete_line(shell_t *sh)
 {
-    char *argv[SHELL_MAX_ARGS + 1];
-    int argc;
+    const char *part = strrchr(sh->linebuf, ' ');
+    part = part ? part + 1 : sh->linebuf;
+    size_t head = (size_t)(part - sh->linebuf);
 
-    sh_putc(sh, '\r'); sh_putc(sh, '\n');
+    /* Split a copy of the finished words */
+    char words[SHELL_LINEBUF_SIZE];
+    char *argv[SHELL_MAX_ARGS + 1], *next, op;
+    memcpy(words, sh->linebuf, head);
+    words[head] = '\0';
+    if (memchr(words, '"', head))
+        return false;
+    int argc = build_argv(words, argv, SHELL_MAX_ARGS, &next, &op);
+    if (next || argc >= SHELL_MAX_ARGS)
+        return false;
 
-    if (sh->line_len == 0) {
-        sh_prompt(sh);
-        return;
+    const shell_cmdset_t *cs = sh->cmdset;
+    const shell_ext_cmd_t *cmd = NULL;
+    int w;
+    for (w = 0; w < argc; w++) {
+        cmd = cs ? sh_resolve(sh, cs, argv[w]) : NULL;
+        if (!cmd)
+            return false;
+#if SHELL_FEATURE_GROUPS
+        if (!cmd->sub)
+            break;
+        cs = cmd->sub;
+#else
+        break;
+#endif
     }
 
-    /* Add to history */
-    shell_add_history(sh, sh->linebuf);
+    size_t len = sh->line_len - head;
+    if (w == argc)
+        return sh_complete_name(sh, cs, part, len);
+#if SHELL_FEATURE_ARGS
+    return sh_complete_args(sh, cmd, argc - w, argv + w, part, len);
+#else
+    return false;
+#endif
+}
 
-    /* We need a mutable copy for build_argv */
-    char line_copy[SHELL_LINEBUF_SIZE];
-    strncpy(line_copy, sh->linebuf, SHELL_LINEBUF_SIZE);
-    line_copy[SHELL_LINEBUF_SIZE - 1] = '\0';
+static void sh_complete(shell_t *sh)
+{
+    // Only complete at end of line
+    if (sh->cursor_pos != sh->line_len || !sh_complete_line(sh))
+        sh_putc(sh, '\a'); // Beep
+}
+#endif /* SHELL_FEATURE_COMPLETION */
 
-    argc = build_argv(line_copy, argv, SHELL_MAX_ARGS);
-    if (argc == 0) {
-        sh_prompt(sh);
+/* ===========================
+ * Bracketed paste
+ * =========================== */
+/* While a paste is open the text right of the cursor is parked at the
+ * end of linebuf, so each pasted byte drops into the gap without a
+ * memmove, and the terminal is updated once when the paste closes. */
+static void paste_begin(shell_t *sh)
+{
+    if (sh->esc.paste) return;
+#if SHELL_FEATURE_HISTORY
+    if (sh->search_active) sr_end(sh, true); /* Paste into the match */
+#endif
+
+    uint16_t tail = (uint16_t)(sh->line_len - sh->cursor_pos);
+    memmove(&sh->linebuf[SHELL_LINEBUF_SIZE - 1 - tail],
+            &sh->linebuf[sh->cursor_pos], tail);
+    sh->esc.paste = true;
+    sh->esc.paste_at = sh->cursor_pos;
+}
+
+/* The line is single-line: newlines and tabs become one space each,
+ * with CR LF counted once, and other controls are dropped. */
+static void paste_char(shell_t *sh, int ch)
+{
+    if (ch == '\n' && sh->cursor_pos > sh->esc.paste_at &&
+        sh->linebuf[sh->cursor_pos - 1] == ' ')
         return;
-    }
+    if (ch == '\r' || ch == '\n' || ch == '\t') ch = ' ';
+    if (ch < 0x20 || ch >= 0x7F) return;
+    if (sh->line_len >= SHELL_LINEBUF_SIZE - 1) return;
 
-    const shell_ext_cmd_t *cmd = art_lookup(sh, argv[0]);
-    if (cmd && cmd->fn) {
-        cmd->fn(argc, argv, cmd->user_data);
-    } else {
-        sh_puts(sh, "Command not found\r\n");
-    }
+    sh->linebuf[sh->cursor_pos++] = (char)ch;
+    sh->line_len++;
+}
 
-    sh_prompt(sh);
+static void paste_end(shell_t *sh)
+{
+    if (!sh->esc.paste) return;
+
+    uint16_t tail = (uint16_t)(sh->line_len - sh->cursor_pos);
+    memmove(&sh->linebuf[sh->cursor_pos],
+            &sh->linebuf[SHELL_LINEBUF_SIZE - 1 - tail], tail);
+    memset(&sh->linebuf[sh->line_len], 0,
+           (size_t)(SHELL_LINEBUF_SIZE - sh->line_len));
+    sh->esc.paste = false;
+    sh_render_insert(sh, sh->esc.paste_at,
+                     (uint16_t)(sh->cursor_pos - sh->esc.paste_at));
 }
 
-void shell_clear_screen(shell_t *sh)
+/* ===========================
+ * Key handling
+ * =========================== */
+static uint16_t word_left(const shell_t *sh, uint16_t pos)
 {
-    sh_puts(sh, ANSI_CLEAR_SCREEN);
-    sh_puts(sh, ANSI_MOVE_CURSOR_HOME);
-    shell_redraw_line(sh);
+    while (pos > 0 && isspace((unsigned char)sh->linebuf[pos - 1]))
+        pos--;
+    while (pos > 0 && !isspace((unsigned char)sh->linebuf[pos - 1]))
+        pos--;
+    return pos;
 }
 
-/* Repositions cursor to the correct spot based on cursor_pos */
-static void sh_reposition_cursor(shell_t *sh)
+static uint16_t word_right(const shell_t *sh, uint16_t pos)
 {
-    sh_putc(sh, '\r');
-    if (sh->cursor_pos + sh->prompt_len > 0) {
-        sh_puts(sh, "\033[");
-        sh_puts_uint(sh, sh->cursor_pos + sh->prompt_len);
-        sh_putc(sh, 'C');
-    }
+    while (pos < sh->line_len && isspace((unsigned char)sh->linebuf[pos]))
+        pos++;
+    while (pos < sh->line_len && !isspace((unsigned char)sh->linebuf[pos]))
+        pos++;
+    return pos;
 }
 
-void shell_insert_text(shell_t *sh, const char *text)
+/* Cut len bytes at pos out of the line, keeping them for Ctrl+Y */
+static void kill_text(shell_t *sh, uint16_t pos, uint16_t len)
 {
-    size_t len = strlen(text);
-    if (sh->line_len + len >= SHELL_LINEBUF_SIZE) {
-        len = SHELL_LINEBUF_SIZE - 1 - sh->line_len;
-    }
-    if (len == 0) return;
-    
-    /* Make space */
-    memmove(&sh->linebuf[sh->cursor_pos + len],
-            &sh->linebuf[sh->cursor_pos],
-            sh->line_len - sh->cursor_pos);
-    
-    /* Insert */
-    memcpy(&sh->linebuf[sh->cursor_pos], text, len);
-    
-    sh->line_len += (uint16_t)len;
-    sh->cursor_pos += (uint16_t)len;
+#if SHELL_FEATURE_KILL_RING
+    memcpy(sh->killed_text, &sh->linebuf[pos], len);
+    sh->killed_text[len] = '\0';
+#endif
+    memmove(&sh->linebuf[pos], &sh->linebuf[pos + len],
+            (size_t)(sh->line_len - pos - len));
+    sh->line_len = (uint16_t)(sh->line_len - len);
     sh->linebuf[sh->line_len] = '\0';
-    
-    shell_redraw_line(sh);
+    sh_render_delete(sh, pos, len);
 }
 
-void shell_redraw_line(shell_t *sh)
+/* Keys carrying SHELL_MOD_* bits; unbound combinations are ignored */
+static bool handle_mod_key(shell_t *sh, shell_key_t key)
 {
-    sh_putc(sh, '\r'); // Go to start of line
-    sh_puts(sh, ANSI_CLEAR_LINE_FROM_CURSOR); // Clear to end of line
-    sh_prompt(sh); // Prints "> " and sets prompt_len
-    
-    for (uint16_t i = 0; i < sh->line_len; i++) {
-        sh_putc(sh, sh->linebuf[i]);
+    switch ((unsigned)key) {
+    case SHELL_KEY_LEFT | SHELL_MOD_CTRL:
+    case SHELL_KEY_LEFT | SHELL_MOD_ALT:
+    case SHELL_MOD_ALT | SHELL_KEY_CHAR | 'b':
+        sh->cursor_pos = word_left(sh, sh->cursor_pos);
+        if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
+        return true;
+
+    case SHELL_KEY_RIGHT | SHELL_MOD_CTRL:
+    case SHELL_KEY_RIGHT | SHELL_MOD_ALT:
+    case SHELL_MOD_ALT | SHELL_KEY_CHAR | 'f':
+        sh->cursor_pos = word_right(sh, sh->cursor_pos);
+        if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
+        return true;
+
+    case SHELL_KEY_DEL | SHELL_MOD_CTRL:
+    case SHELL_MOD_ALT | SHELL_KEY_CHAR | 'd': {
+        /* Kill word forwards */
+        uint16_t end = word_right(sh, sh->cursor_pos);
+        if (end > sh->cursor_pos)
+            kill_text(sh, sh->cursor_pos, (uint16_t)(end - sh->cursor_pos));
+        return true;
     }
-    
-    // Now move cursor back to correct position
-    sh_reposition_cursor(sh);
-}
 
-const char *shell_get_line(shell_t *sh)
-{
-    return sh->linebuf;
+    default:
+        return false;
+    }
 }
 
 static bool handle_key_event(shell_t *sh, shell_key_t key)
 {
+#if SHELL_FEATURE_HISTORY
+    if (sh->search_active && sr_key(sh, key))
+        return true;
+#endif
+
+#if SHELL_FEATURE_KEYBINDS
     /* Check custom bindings first */
     for (uint8_t i = 0; i < sh->keybind_count; i++) {
         if (sh->keybinds[i].key == key) {
             if (sh->keybinds[i].handler) {
-                if (sh->keybinds[i].handler(sh, key, sh->keybinds[i].user_data))
-                    return true; /* Handled */
+                shell_keybind_t kb = sh->keybinds[i];
+                sh_callout_begin(sh); /* Handler may write on its own */
+                bool handled = kb.handler(sh, key, kb.user_data);
+                sh_callout_end(sh);
+                if (handled)
+                    return true;
             }
         }
     }
+#endif
+
+    /* Alt+Backspace kills a word like Ctrl+W */
+    if (key == SHELL_KEY_MOD(SHELL_KEY_BACKSPACE, SHELL_MOD_ALT))
+        key = SHELL_KEY_CTRL_W;
+    else if ((unsigned)key >= SHELL_KEY_CHAR)
+        return handle_mod_key(sh, key);
 
     /* Default handlers */
     switch (key) {
     case SHELL_KEY_CTRL_A:
     case SHELL_KEY_HOME:
         sh->cursor_pos = 0;
-        sh_reposition_cursor(sh);
+        if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
         return true;
 
     case SHELL_KEY_CTRL_E:
     case SHELL_KEY_END:
         sh->cursor_pos = sh->line_len;
-        sh_reposition_cursor(sh);
+        if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
         return true;
 
     case SHELL_KEY_CTRL_B:
     case SHELL_KEY_LEFT:
         if (sh->cursor_pos > 0) {
             sh->cursor_pos--;
-            sh_putc(sh, '\b');
+            if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
         }
         return true;
 
     case SHELL_KEY_CTRL_F:
     case SHELL_KEY_RIGHT:
         if (sh->cursor_pos < sh->line_len) {
-            sh_putc(sh, sh->linebuf[sh->cursor_pos]);
             sh->cursor_pos++;
+            if (sh->echo_enabled) sh_move_cursor(sh, sh->cursor_pos);
         }
         return true;
 
@@ -622,20 +3839,14 @@ static bool handle_key_event(shell_t *sh, shell_key_t key)
                     sh->line_len - sh->cursor_pos);
             sh->line_len--;
             sh->linebuf[sh->line_len] = 0;
-            shell_redraw_line(sh);
+            sh_render_delete(sh, sh->cursor_pos, 1);
         }
         return true;
 
     case SHELL_KEY_CTRL_K:
         if (sh->cursor_pos < sh->line_len) {
             /* Kill from cursor to end */
-            uint16_t killed_len = sh->line_len - sh->cursor_pos;
-            memcpy(sh->killed_text, &sh->linebuf[sh->cursor_pos], killed_len);
-            sh->killed_text[killed_len] = '\0';
-            
-            sh->line_len = sh->cursor_pos;
-            sh->linebuf[sh->line_len] = 0;
-            shell_redraw_line(sh);
+            kill_text(sh, sh->cursor_pos, (uint16_t)(sh->line_len - sh->cursor_pos));
         }
         return true;
 
@@ -643,14 +3854,8 @@ static bool handle_key_event(shell_t *sh, shell_key_t key)
         if (sh->cursor_pos > 0) {
             /* Kill from beginning to cursor */
             uint16_t killed_len = sh->cursor_pos;
-            memcpy(sh->killed_text, sh->linebuf, killed_len);
-            sh->killed_text[killed_len] = '\0';
-
-            memmove(sh->linebuf, &sh->linebuf[sh->cursor_pos], sh->line_len - sh->cursor_pos);
-            sh->line_len -= sh->cursor_pos;
             sh->cursor_pos = 0;
-            sh->linebuf[sh->line_len] = 0;
-            shell_redraw_line(sh);
+            kill_text(sh, 0, killed_len);
         }
         return true;
 
@@ -665,19 +3870,32 @@ static bool handle_key_event(shell_t *sh, shell_key_t key)
             start--;
 
         if (start < sh->cursor_pos) {
-            uint16_t killed_len = sh->cursor_pos - start;
-            memcpy(sh->killed_text, &sh->linebuf[start], killed_len);
-            sh->killed_text[killed_len] = '\0';
-
-            memmove(&sh->linebuf[start], &sh->linebuf[sh->cursor_pos], 
-                    sh->line_len - sh->cursor_pos);
-            sh->line_len -= killed_len;
+            uint16_t killed_len = (uint16_t)(sh->cursor_pos - start);
             sh->cursor_pos = start;
+            kill_text(sh, start, killed_len);
+        }
+        return true;
+    }
+
+#if SHELL_FEATURE_KILL_RING
+    case SHELL_KEY_CTRL_Y: {
+        /* Yank: as much of the last kill as fits */
+        uint16_t n = (uint16_t)strlen(sh->killed_text);
+        uint16_t room = (uint16_t)(SHELL_LINEBUF_SIZE - 1 - sh->line_len);
+        if (n > room) n = room;
+        if (n > 0) {
+            uint16_t at = sh->cursor_pos;
+            memmove(&sh->linebuf[at + n], &sh->linebuf[at],
+                    (size_t)(sh->line_len - at));
+            memcpy(&sh->linebuf[at], sh->killed_text, n);
+            sh->line_len = (uint16_t)(sh->line_len + n);
+            sh->cursor_pos = (uint16_t)(at + n);
             sh->linebuf[sh->line_len] = '\0';
-            shell_redraw_line(sh);
+            sh_render_insert(sh, at, n);
         }
         return true;
     }
+#endif
 
     case SHELL_KEY_CTRL_T:
         /* Transpose characters */
@@ -689,22 +3907,24 @@ static bool handle_key_event(shell_t *sh, shell_key_t key)
                 char tmp = sh->linebuf[pos];
                 sh->linebuf[pos] = sh->linebuf[pos - 1];
                 sh->linebuf[pos - 1] = tmp;
-                shell_redraw_line(sh);
+                sh_render_replace(sh, (uint16_t)(pos - 1), 2);
             }
         }
         return true;
 
     case SHELL_KEY_CTRL_L:
-        shell_clear_screen(sh);
+        sh_clear_screen(sh);
         return true;
 
     case SHELL_KEY_CTRL_C:
+        sh_render_leave(sh);
         sh_putc(sh, '^'); sh_putc(sh, 'C');
         sh_putc(sh, '\r'); sh_putc(sh, '\n');
         reset_line(sh);
         sh_prompt(sh);
         return true;
 
+#if SHELL_FEATURE_HISTORY
     case SHELL_KEY_CTRL_P:
     case SHELL_KEY_UP:
         history_prev(sh);
@@ -715,136 +3935,24 @@ static bool handle_key_event(shell_t *sh, shell_key_t key)
         history_next(sh);
         return true;
 
+    case SHELL_KEY_CTRL_R:
+        sr_start(sh);
+        return true;
+#endif
+
+#if SHELL_FEATURE_COMPLETION
     case SHELL_KEY_TAB:
         if (sh->complete_cb) {
             /* User has a custom override callback */
+            sh_callout_begin(sh);
             sh->complete_cb(sh, shell_get_line(sh), NULL, 0);
+            sh_callout_end(sh);
         } else {
             /* Default built-in command completion */
-            const char *line = sh->linebuf;
-            size_t len = sh->line_len;
-
-            // Only complete at end of line
-            if (sh->cursor_pos != sh->line_len) {
-                sh_putc(sh, '\a'); // Beep
-                return true;
-            }
-
-            // Check if we're completing the first word (command)
-            bool in_first_word = true;
-            for (size_t i = 0; i < len; i++) {
-                if (line[i] == ' ') {
-                    in_first_word = false;
-                    break;
-                }
-            }
-            
-            if (!in_first_word) {
-                sh_putc(sh, '\a'); // Beep
-                return true; // Don't complete arguments
-            }
-
-            int match_count = 0;
-            int last_match_idx = -1;
-            char common_prefix[SHELL_LINEBUF_SIZE];
-            common_prefix[0] = '\0';
-
-            // Find matching commands
-            for (uint16_t i = 0; i < sh->cmd_count; i++) {
-                const char *cmd_name = sh->cmd_table[i].name;
-                
-                // Check if command starts with current input
-                if (strncmp(cmd_name, line, len) == 0 && cmd_name[len] != '\0') {
-                    match_count++;
-                    last_match_idx = i;
-                    
-                    if (match_count == 1) {
-                        strncpy(common_prefix, cmd_name, SHELL_LINEBUF_SIZE - 1);
-                        common_prefix[SHELL_LINEBUF_SIZE - 1] = '\0';
-                    } else {
-                        // Update common prefix
-                        size_t j = 0;
-                        while (common_prefix[j] && cmd_name[j] && common_prefix[j] == cmd_name[j]) {
-                            j++;
-                        }
-                        common_prefix[j] = '\0';
-                    }
-                }
-            }
-
-            if (match_count == 0) {
-                // No matches - beep
-                sh_putc(sh, '\a');
-            } else if (match_count == 1) {
-                // Single match - complete it with a space
-                const char *cmd_name = sh->cmd_table[last_match_idx].name;
-                
-                // Overwrite current line buffer
-                strncpy(sh->linebuf, cmd_name, SHELL_LINEBUF_SIZE - 2);
-                strncat(sh->linebuf, " ", SHELL_LINEBUF_SIZE - 1);
-                sh->line_len = (uint16_t)strlen(sh->linebuf);
-                sh->cursor_pos = sh->line_len;
-                shell_redraw_line(sh);
-            } else {
-                // Multiple matches
-                size_t common_len = strlen(common_prefix);
-                
-                if (common_len > len) {
-                    // Insert common prefix
-                    shell_insert_text(sh, common_prefix + len);
-                } else {
-                    // Show all matches
-                    sh_putc(sh, '\r'); sh_putc(sh, '\n');
-
-                    const int cols = 80;
-                    int max_width = 0;
-
-                    // Find longest command name
-                    for (uint16_t i = 0; i < sh->cmd_count; i++) {
-                        const char *cmd_name = sh->cmd_table[i].name;
-                        if (strncmp(cmd_name, line, len) == 0 && cmd_name[len] != '\0') {
-                            int name_len = (int)strlen(cmd_name);
-                            if (name_len > max_width) {
-                                max_width = name_len;
-                            }
-                        }
-                    }
-
-                    int col_width = max_width + 2;
-                    int num_cols = cols / col_width;
-                    if (num_cols < 1) num_cols = 1;
-
-                    // Display matches in columns
-                    int col = 0;
-                    for (uint16_t i = 0; i < sh->cmd_count; i++) {
-                        const char *cmd_name = sh->cmd_table[i].name;
-                        if (strncmp(cmd_name, line, len) == 0 && cmd_name[len] != '\0') {
-                            sh_puts(sh, cmd_name);
-                            
-                            // Add padding
-                            int pad = col_width - (int)strlen(cmd_name);
-                            for (int p = 0; p < pad; p++) {
-                                sh_putc(sh, ' ');
-                            }
-
-                            col++;
-                            if (col >= num_cols) {
-                                sh_putc(sh, '\r'); sh_putc(sh, '\n');
-                                col = 0;
-                            }
-                        }
-                    }
-                    
-                    if (col > 0) {
-                        sh_putc(sh, '\r'); sh_putc(sh, '\n');
-                    }
-
-                    // Redraw prompt and line
-                    shell_redraw_line(sh);
-                }
-            }
+            sh_complete(sh);
         }
         return true;
+#endif
 
     default:
         return false;
@@ -859,7 +3967,25 @@ static void handle_line_char(shell_t *sh, int ch)
     sh_parse_result_t res = esc_parse(sh, ch, &key);
     if (res == SH_PARSE_CONTINUE) {
         return;
-    } else if (res == SH_PARSE_COMPLETE) {
+    } else if (res == SH_PARSE_PASTE_BEGIN) {
+        paste_begin(sh);
+        return;
+    } else if (res == SH_PARSE_PASTE_END) {
+        paste_end(sh);
+        return;
+    }
+
+    if (sh->esc.paste) {
+        if (res == SH_PARSE_NONE && ch != 0x03) {
+            paste_char(sh, ch);
+            return;
+        }
+        if (res == SH_PARSE_COMPLETE)
+            return; /* Keys inside a paste are not keys */
+        paste_end(sh); /* Ctrl+C closes a paste whose end got lost */
+    }
+
+    if (res == SH_PARSE_COMPLETE) {
         if (key != SHELL_KEY_NONE) {
             handle_key_event(sh, key);
         }
@@ -884,6 +4010,7 @@ static void handle_line_char(shell_t *sh, int ch)
         case 20: key = SHELL_KEY_CTRL_T; break;
         case 21: key = SHELL_KEY_CTRL_U; break;
         case 23: key = SHELL_KEY_CTRL_W; break;
+        case 25: key = SHELL_KEY_CTRL_Y; break;
         default: break;
         }
         if (key != SHELL_KEY_NONE) {
@@ -892,10 +4019,16 @@ static void handle_line_char(shell_t *sh, int ch)
         }
     }
 
+#if SHELL_FEATURE_HISTORY
+    if (sh->search_active && sr_char(sh, ch))
+        return;
+#endif
+
     /* Enter/Return */
     if (ch == '\r' || ch == '\n') {
         exec_line(sh);
-        reset_line(sh);
+        if (!sh->job_cmd)
+            reset_line(sh); /* A started job still needs its argv */
         return;
     }
 
@@ -908,7 +4041,7 @@ static void handle_line_char(shell_t *sh, int ch)
             sh->line_len--;
             sh->cursor_pos--;
             sh->linebuf[sh->line_len] = 0;
-            shell_redraw_line(sh);
+            sh_render_delete(sh, sh->cursor_pos, 1);
         }
         return;
     }
@@ -924,16 +4057,206 @@ static void handle_line_char(shell_t *sh, int ch)
             sh->cursor_pos++;
             sh->linebuf[sh->line_len] = '\0';
             
-            if (sh->echo_enabled) {
-                shell_redraw_line(sh);
-            }
+            sh_render_insert(sh, (uint16_t)(sh->cursor_pos - 1), 1);
         }
     }
 }
 
 /* ===========================
- * Public API
+ * Binary RPC mode
+ *
+ * Frames are parsed a byte at a time as they arrive, the crc running
+ * along, and dispatch by table index straight to the rpc handler.
+ * Replies are staged like any output, so a burst of requests read in
+ * one shell_run() goes back in one transfer.
  * =========================== */
+#if SHELL_ENABLE_RPC
+#if SHELL_RPC_MAX_PAYLOAD > 255 || SHELL_RPC_MAX_PAYLOAD > SHELL_LINEBUF_SIZE
+#error "SHELL_RPC_MAX_PAYLOAD must fit the length byte and linebuf"
+#endif
+#if SHELL_RPC_MAX_PAYLOAD < 3
+#error "SHELL_RPC_MAX_PAYLOAD must hold the 3-byte info reply"
+#endif
+
+enum {
+    RPC_HUNT = 0, RPC_SEQ, RPC_ID_LO, RPC_ID_HI, RPC_LEN, RPC_DATA,
+    RPC_CRC_LO, RPC_CRC_HI
+};
+
+static const char rpc_magic[] = SHELL_RPC_MAGIC;
+
+static uint16_t rpc_crc16(uint16_t crc, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        crc ^= (uint16_t)(*p++ << 8);
+        for (uint8_t b = 0; b < 8; b++)
+            crc = (uint16_t)((crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1);
+    }
+    return crc;
+}
+
+static void rpc_reply(shell_t *sh, uint8_t status, const uint8_t *data, size_t len)
+{
+    uint8_t hdr[4] = { SHELL_RPC_SOF, sh->rpc_seq, status, (uint8_t)len };
+    uint16_t crc = rpc_crc16(rpc_crc16(0xFFFF, hdr + 1, 3), data, len);
+    uint8_t tail[2] = { (uint8_t)crc, (uint8_t)(crc >> 8) };
+
+    sh_write(sh, (const char *)hdr, sizeof hdr);
+    sh_write(sh, (const char *)data, len);
+    sh_write(sh, (const char *)tail, sizeof tail);
+}
+
+static void rpc_enter(shell_t *sh)
+{
+    reset_line(sh);
+    esc_reset(&sh->esc);
+#if SHELL_FEATURE_HISTORY
+    sh->search_active = false;
+#endif
+    sh->rpc       = true;
+    sh->rpc_magic = 0;
+    sh->rpc_state = RPC_HUNT;
+}
+
+static void rpc_leave(shell_t *sh)
+{
+    reset_line(sh);
+    sh->rpc = false;
+    sh_puts(sh, "\r\n");
+    sh_prompt(sh);
+}
+
+/* Reserved id SHELL_RPC_ID_INFO: table size, or one command's name */
+static uint8_t rpc_info(shell_t *sh, uint8_t *resp, size_t *resp_len)
+{
+    const shell_cmdset_t *cs = sh->cmdset;
+    uint16_t count = (cs && cs->cmd_table) ? cs->cmd_count : 0;
+    const uint8_t *req = (const uint8_t *)sh->linebuf;
+
+    if (sh->rpc_len == 0) {
+        resp[0] = (uint8_t)count;
+        resp[1] = (uint8_t)(count >> 8);
+        resp[2] = SHELL_RPC_MAX_PAYLOAD;
+        *resp_len = 3;
+        return 0;
+    }
+    uint16_t id = sh->rpc_len == 2 ? (uint16_t)(req[0] | req[1] << 8) : 0xFFFF;
+    if (id >= count)
+        return SHELL_EXIT_NOT_FOUND;
+    const char *name = cs_cmd(cs, id)->name;
+    size_t n = strlen(name);
+    if (n > SHELL_RPC_MAX_PAYLOAD) n = SHELL_RPC_MAX_PAYLOAD;
+    memcpy(resp, name, n);
+    *resp_len = n;
+    return 0;
+}
+
+/* A whole frame is in: run it and answer */
+static void rpc_dispatch(shell_t *sh, bool crc_ok)
+{
+    uint8_t resp[SHELL_RPC_MAX_PAYLOAD];
+    size_t resp_len = 0;
+    uint8_t status;
+    const shell_cmdset_t *cs = sh->cmdset;
+    uint16_t count = (cs && cs->cmd_table) ? cs->cmd_count : 0;
+
+    if (!crc_ok) {
+        status = SHELL_RPC_E_CRC;
+    } else if (sh->rpc_len > SHELL_RPC_MAX_PAYLOAD) {
+        status = SHELL_RPC_E_LENGTH;
+    } else if (sh->rpc_id == SHELL_RPC_ID_EXIT) {
+        rpc_reply(sh, 0, NULL, 0);
+        rpc_leave(sh);
+        return;
+    } else if (sh->rpc_id == SHELL_RPC_ID_INFO) {
+        status = rpc_info(sh, resp, &resp_len);
+    } else if (sh->rpc_id >= count) {
+        status = SHELL_EXIT_NOT_FOUND;
+    } else if (!cs_cmd(cs, sh->rpc_id)->rpc) {
+        status = SHELL_RPC_E_NO_RPC;
+    } else {
+        const shell_ext_cmd_t *cmd = cs_cmd(cs, sh->rpc_id);
+        resp_len = sizeof resp;
+        uint32_t t0 = mt_clock(sh);
+        sh_callout_begin(sh);
+        int st = cmd->rpc((const uint8_t *)sh->linebuf, sh->rpc_len,
+                          resp, &resp_len, cmd->user_data);
+        sh_callout_end(sh);
+        mt_cmd(sh, cmd, t0, 1);
+        if (resp_len > sizeof resp) resp_len = sizeof resp;
+        sh->last_status = st;
+        status = (uint8_t)st;
+    }
+    rpc_reply(sh, status, resp, resp_len);
+}
+
+/* RPC mode input: one byte of a frame */
+static void rpc_char(shell_t *sh, uint8_t ch)
+{
+    switch (sh->rpc_state) {
+    case RPC_HUNT:
+        if (ch == SHELL_RPC_SOF) {
+            sh->rpc_crc   = 0xFFFF;
+            sh->rpc_state = RPC_SEQ;
+        }
+        return;
+    case RPC_SEQ:
+        sh->rpc_seq = ch;
+        break;
+    case RPC_ID_LO:
+        sh->rpc_id = ch;
+        break;
+    case RPC_ID_HI:
+        sh->rpc_id = (uint16_t)(sh->rpc_id | ch << 8);
+        break;
+    case RPC_LEN:
+        sh->rpc_len = ch;
+        sh->rpc_got = 0;
+        sh->rpc_crc = rpc_crc16(sh->rpc_crc, &ch, 1);
+        sh->rpc_state = ch ? RPC_DATA : RPC_CRC_LO;
+        return;
+    case RPC_DATA:
+        /* Over-long payloads are still counted and checked, not kept */
+        if (sh->rpc_got < SHELL_RPC_MAX_PAYLOAD)
+            sh->linebuf[sh->rpc_got] = (char)ch;
+        sh->rpc_crc = rpc_crc16(sh->rpc_crc, &ch, 1);
+        if (++sh->rpc_got == sh->rpc_len)
+            sh->rpc_state = RPC_CRC_LO;
+        return;
+    case RPC_CRC_LO:
+        sh->rpc_crc_lo = ch;
+        sh->rpc_state  = RPC_CRC_HI;
+        return;
+    default:
+        sh->rpc_state = RPC_HUNT;
+        rpc_dispatch(sh, sh->rpc_crc == (uint16_t)(sh->rpc_crc_lo | ch << 8));
+        return;
+    }
+    sh->rpc_crc = rpc_crc16(sh->rpc_crc, &ch, 1);
+    sh->rpc_state++;
+}
+
+/* At the prompt: hold back bytes that match the magic so far and hand
+ * them to the editor after all if it breaks off. True if ch was taken. */
+static bool rpc_watch(shell_t *sh, int ch)
+{
+    if ((uint8_t)rpc_magic[sh->rpc_magic] == ch) {
+        if (++sh->rpc_magic == sizeof rpc_magic - 1)
+            rpc_enter(sh);
+        return true;
+    }
+    uint8_t held = sh->rpc_magic;
+    sh->rpc_magic = 0;
+    for (uint8_t i = 0; i < held; i++)
+        handle_line_char(sh, (uint8_t)rpc_magic[i]);
+    if (held && (uint8_t)rpc_magic[0] == ch) {
+        sh->rpc_magic = 1;
+        return true;
+    }
+    return false;
+}
+#endif
+
 shell_status_t shell_init(shell_t              *sh,
                           shell_putchar_func     putc_f,
                           shell_getchar_func     getc_f)
@@ -944,91 +4267,275 @@ shell_status_t shell_init(shell_t              *sh,
     sh->putc_f = putc_f;
     sh->getc_f = getc_f;
 
-    /* Init ART root */
-    for (int i = 0; i < SHELL_ART_MAX_NODES; i++) {
-        sh->art_nodes[i].n_children = 0;
-        sh->art_nodes[i].key = 0;
-        sh->art_nodes[i].cmd_idx = -1;
-        for (int j = 0; j < SHELL_ART_MAX_CHILDREN; j++) {
-            sh->art_nodes[i].child_idx[j] = -1;
-            sh->art_nodes[i].child_key[j] = 0;
-        }
-    }
-    sh->art_root = 0;
-    sh->art_free = 1;
-    sh->art_max_used = 1;
-    sh->art_overflow = false;
+    /* Commands arrive with shell_load_table() or shell_set_cmdset() */
+    sh->cmdset = NULL;
     esc_reset(&sh->esc);
 
+#if SHELL_FEATURE_HISTORY
     /* History */
     sh->history_pos = -1;
+    sh->history_tail = 0;
     sh->history_head = 0;
+    sh->history_wrap = 0;
     sh->history_count = 0;
+#endif
 
     /* Flags */
     sh->echo_enabled = true;
     sh->initial_prompt_shown = false;
     sh->prompt_len = 2; /* Default */
+#if SHELL_FEATURE_WRAP
+    sh->term_cols = SHELL_TERM_COLS;
+#endif
 
     return SHELL_OK;
 }
 
-shell_status_t shell_load_table(shell_t *sh,
-                                const shell_ext_cmd_t *table,
-                                uint16_t count)
+/* Index the table(s) just stored in cs, as shell_load_table() does */
+static shell_status_t cs_index(shell_cmdset_t *cs)
+{
+#if !SHELL_FEATURE_ART
+    cs->sorted = cs_is_sorted(cs);
+#if SHELL_DISPATCH_PHF
+    phf_build(cs);
+#endif
+    return SHELL_OK;
+#elif SHELL_ART_ARENA_SIZE > 0
+    cs->sorted = cs_is_sorted(cs);
+
+    art_reset(cs);
+    bool fits = cs->art_root != ART_NIL;
+    for (uint16_t i = 0; fits && i < cs->cmd_count; i++) {
+        const char *name = cs_cmd(cs, i)->name;
+        if (name)
+            fits = art_insert(cs, name, i);
+    }
+    if (!fits) {
+        /* Slower, but every command still works */
+        cs->art = NULL;
+        cs->art_overflow = true;
+    }
+
+#if SHELL_DISPATCH_PHF
+    phf_build(cs);
+#endif
+    return SHELL_OK;
+#else
+    (void)cs;
+    return SHELL_ERR_NO_SPACE; /* No arena; use shell_load_prebuilt_trie() */
+#endif
+}
+
+shell_status_t shell_cmdset_load_table(shell_cmdset_t *cs,
+                                       const shell_ext_cmd_t *table,
+                                       uint16_t count)
 {
-    if (!sh || !table) return SHELL_ERR_ARG;
+    if (!cs || !table) return SHELL_ERR_ARG;
 
-    sh->cmd_table = table;
-    sh->cmd_count = count;
+    cs->cmd_table = table;
+    cs->cmd_count = count;
+#if SHELL_FEATURE_SPANS
+    cs->spans     = NULL;
+#endif
+    return cs_index(cs);
+}
 
-    /* Reset ART */
-    for (int i = 0; i < SHELL_ART_MAX_NODES; i++) {
-        sh->art_nodes[i].n_children = 0;
-        sh->art_nodes[i].key = 0;
-        sh->art_nodes[i].cmd_idx = -1;
-        for (int j = 0; j < SHELL_ART_MAX_CHILDREN; j++) {
-            sh->art_nodes[i].child_idx[j] = -1;
-            sh->art_nodes[i].child_key[j] = 0;
-        }
+shell_status_t shell_cmdset_load_spans(shell_cmdset_t *cs,
+                                       const shell_cmd_span_t *spans, uint8_t n)
+{
+    uint32_t total = 0;
+
+    if (!cs || !spans || n == 0) return SHELL_ERR_ARG;
+    for (uint8_t i = 0; i < n; i++) {
+        if (!spans[i].table) return SHELL_ERR_ARG;
+        total += spans[i].count;
     }
-    sh->art_root = 0;
-    sh->art_free = 1;
-    sh->art_max_used = 1;
-    sh->art_overflow = false;
+    if (total >= ART_NIL) return SHELL_ERR_ARG; /* Ids must stay below it */
+    if (n == 1)
+        return shell_cmdset_load_table(cs, spans[0].table, spans[0].count);
 
-    for (uint16_t i = 0; i < count; i++) {
-        const char *name = table[i].name;
-        if (!name) continue;
-        if (!art_insert(sh, name, (int16_t)i)) {
-            sh->art_overflow = true;
-            return SHELL_ERR_ART_OVERFLOW;
-        }
+#if SHELL_FEATURE_SPANS
+    if (n > SHELL_MAX_SPANS) return SHELL_ERR_NO_SPACE;
+    uint16_t base = 0;
+    for (uint8_t i = 0; i < n; i++) {
+        cs->span_base[i] = base;
+        base = (uint16_t)(base + spans[i].count);
     }
+    cs->cmd_table  = spans[0].table;
+    cs->cmd_count  = base;
+    cs->spans      = spans;
+    cs->span_count = n;
+    return cs_index(cs);
+#else
+    return SHELL_ERR_NO_SPACE;
+#endif
+}
+
+shell_status_t shell_cmdset_load_prebuilt_trie(shell_cmdset_t *cs,
+                                               const shell_ext_cmd_t *table,
+                                               uint16_t count,
+                                               const shell_art_prebuilt_t *trie)
+{
+    if (!cs || !table || !trie || !trie->arena || trie->root >= trie->size)
+        return SHELL_ERR_ARG;
+    if (trie->cmd_count != count)
+        return SHELL_ERR_ARG; /* Trie was generated for a different table */
 
+    cs->cmd_table    = table;
+    cs->cmd_count    = count;
+#if SHELL_FEATURE_SPANS
+    cs->spans        = NULL;
+#endif
+#if SHELL_FEATURE_ART
+    cs->sorted       = false;
+    cs->art          = trie->arena;
+    cs->art_root     = trie->root;
+    cs->art_used     = trie->size;
+    cs->art_max_used = trie->node_count;
+    cs->art_flat_nodes = 0; /* Unknown for prebuilt tries */
+    cs->art_overflow = false;
+#else
+    cs->sorted       = tbl_is_sorted(table, count); /* The table alone is enough */
+#endif
+#if SHELL_DISPATCH_PHF
+    phf_build(cs);
+#endif
     return SHELL_OK;
 }
 
+shell_status_t shell_cmdset_load_sorted(shell_cmdset_t *cs,
+                                        const shell_ext_cmd_t *table,
+                                        uint16_t count)
+{
+    if (!cs || !table || !tbl_is_sorted(table, count))
+        return SHELL_ERR_ARG;
+
+    cs->cmd_table    = table;
+    cs->cmd_count    = count;
+#if SHELL_FEATURE_SPANS
+    cs->spans        = NULL;
+#endif
+    cs->sorted       = true;
+#if SHELL_FEATURE_ART
+    cs->art          = NULL;
+    cs->art_used     = 0;
+    cs->art_max_used = 0;
+    cs->art_flat_nodes = 0;
+    cs->art_overflow = false;
+#endif
+#if SHELL_DISPATCH_PHF
+    phf_build(cs);
+#endif
+    return SHELL_OK;
+}
+
+void shell_set_cmdset(shell_t *sh, const shell_cmdset_t *cs)
+{
+    if (!sh) return;
+    sh_lock(sh);
+    sh->cmdset = cs;
+    sh_unlock(sh);
+}
+
+shell_status_t shell_load_table(shell_t *sh,
+                                const shell_ext_cmd_t *table,
+                                uint16_t count)
+{
+    if (!sh) return SHELL_ERR_ARG;
+#if SHELL_EMBED_CMDSET
+    sh_lock(sh);
+    sh->cmdset = &sh->cmdset_own;
+    shell_status_t st = shell_cmdset_load_table(&sh->cmdset_own, table, count);
+    sh_unlock(sh);
+    return st;
+#else
+    (void)table; (void)count;
+    return SHELL_ERR_NO_SPACE; /* No embedded set; use shell_set_cmdset() */
+#endif
+}
+
+shell_status_t shell_load_spans(shell_t *sh, const shell_cmd_span_t *spans, uint8_t n)
+{
+    if (!sh) return SHELL_ERR_ARG;
+#if SHELL_EMBED_CMDSET
+    sh_lock(sh);
+    sh->cmdset = &sh->cmdset_own;
+    shell_status_t st = shell_cmdset_load_spans(&sh->cmdset_own, spans, n);
+    sh_unlock(sh);
+    return st;
+#else
+    (void)spans; (void)n;
+    return SHELL_ERR_NO_SPACE;
+#endif
+}
+
+shell_status_t shell_load_sorted(shell_t *sh,
+                                 const shell_ext_cmd_t *table,
+                                 uint16_t count)
+{
+    if (!sh) return SHELL_ERR_ARG;
+#if SHELL_EMBED_CMDSET
+    sh_lock(sh);
+    sh->cmdset = &sh->cmdset_own;
+    shell_status_t st = shell_cmdset_load_sorted(&sh->cmdset_own, table, count);
+    sh_unlock(sh);
+    return st;
+#else
+    (void)table; (void)count;
+    return SHELL_ERR_NO_SPACE;
+#endif
+}
+
+shell_status_t shell_load_prebuilt_trie(shell_t *sh,
+                                        const shell_ext_cmd_t *table,
+                                        uint16_t count,
+                                        const shell_art_prebuilt_t *trie)
+{
+    if (!sh) return SHELL_ERR_ARG;
+#if SHELL_EMBED_CMDSET
+    sh_lock(sh);
+    sh->cmdset = &sh->cmdset_own;
+    shell_status_t st = shell_cmdset_load_prebuilt_trie(&sh->cmdset_own, table, count, trie);
+    sh_unlock(sh);
+    return st;
+#else
+    (void)table; (void)count; (void)trie;
+    return SHELL_ERR_NO_SPACE;
+#endif
+}
+
 void shell_set_login(shell_t *sh,
                      shell_login_cb cb,
                      char trigger_char)
 {
+#if SHELL_FEATURE_LOGIN
     if (!sh) return;
     sh->login_cb      = cb;
     sh->login_trigger = trigger_char;
+#else
+    (void)sh; (void)cb; (void)trigger_char;
+#endif
 }
 
 void shell_logout(shell_t *sh)
 {
+#if SHELL_FEATURE_LOGIN
     if (!sh) return;
     sh->logged_in  = false;
     login_reset(sh);
+#else
+    (void)sh;
+#endif
 }
 
-bool shell_bind_key(shell_t *sh, shell_key_t key, 
-                    shell_key_handler handler, void *user_data)
+static bool sh_bind_key(shell_t *sh, shell_key_t key,
+                        shell_key_handler handler, void *user_data)
 {
-    if (!sh || sh->keybind_count >= SHELL_MAX_KEYBINDS)
+#if !SHELL_FEATURE_KEYBINDS
+    (void)sh; (void)key; (void)handler; (void)user_data;
+    return false;
+#else
+    if (sh->keybind_count >= SHELL_MAX_KEYBINDS)
         return false;
 
     /* Check if already bound, replace if so */
@@ -1046,12 +4553,25 @@ bool shell_bind_key(shell_t *sh, shell_key_t key,
     sh->keybinds[sh->keybind_count].user_data = user_data;
     sh->keybind_count++;
     return true;
+#endif
+}
+
+bool shell_bind_key(shell_t *sh, shell_key_t key, 
+                    shell_key_handler handler, void *user_data)
+{
+    if (!sh) return false;
+    sh_lock(sh);
+    bool ok = sh_bind_key(sh, key, handler, user_data);
+    sh_unlock(sh);
+    return ok;
 }
 
 void shell_unbind_key(shell_t *sh, shell_key_t key)
 {
+#if SHELL_FEATURE_KEYBINDS
     if (!sh) return;
 
+    sh_lock(sh);
     for (uint8_t i = 0; i < sh->keybind_count; i++) {
         if (sh->keybinds[i].key == key) {
             /* Shift remaining bindings down */
@@ -1059,15 +4579,214 @@ void shell_unbind_key(shell_t *sh, shell_key_t key)
                 sh->keybinds[j] = sh->keybinds[j + 1];
             }
             sh->keybind_count--;
-            return;
+            break;
+        }
+    }
+    sh_unlock(sh);
+#else
+    (void)sh; (void)key;
+#endif
+}
+
+void shell_set_clock(shell_t *sh, shell_clock_func now, uint32_t slice)
+{
+    if (!sh) return;
+    sh->clock_f   = now;
+    sh->job_slice = slice;
+}
+
+bool shell_is_busy(const shell_t *sh)
+{
+    return sh && sh->job_cmd;
+}
+
+shell_status_t shell_exec_script(shell_t *sh, const char *buf, size_t len)
+{
+    char line[SHELL_LINEBUF_SIZE];
+    shell_status_t first = SHELL_OK;
+    uint16_t line_no = 0;
+
+    if (!sh || (!buf && len)) return SHELL_ERR_ARG;
+
+    sh_lock(sh);
+    if (sh->job_cmd) {
+        sh_unlock(sh);
+        return SHELL_ERR_BUSY;
+    }
+
+    const char *p = buf, *end = buf + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *eol = nl ? nl : end;
+        size_t n = (size_t)(eol - p);
+        if (n && p[n - 1] == '\r') n--;
+
+        bool too_long = n > sizeof line - 1;
+        if (!too_long) {
+            memcpy(line, p, n);
+            line[n] = '\0';
+        }
+        shell_status_t st = batch_line(sh, ++line_no, line, too_long);
+        if (st != SHELL_OK && first == SHELL_OK)
+            first = st;
+        p = nl ? nl + 1 : end;
+    }
+
+    sh_flush(sh);
+    sh_unlock(sh);
+    return first;
+}
+
+shell_status_t shell_exec_capture(shell_t *sh, const char *line,
+                                  char *out, size_t out_size, size_t *out_len)
+{
+#if SHELL_FEATURE_CAPTURE
+    char buf[SHELL_LINEBUF_SIZE];
+    shell_status_t st;
+
+    if (!sh || !line || !out || !out_size) return SHELL_ERR_ARG;
+
+    sh_lock(sh);
+    if (sh->job_cmd) {
+        sh_unlock(sh);
+        return SHELL_ERR_BUSY;
+    }
+
+    /* What is staged belongs to whoever was capturing before (if anyone) */
+#if SHELL_TX_RING_SIZE > 0
+    while (sh->tx_len && sh_tx_drain(sh, true))
+        ;
+    MT_ADD(sh, tx_drops, sh->tx_len);
+    sh->tx_len = 0;
+#else
+    sh_flush(sh);
+#endif
+    char  *prev_buf  = sh->cap_buf;
+    size_t prev_size = sh->cap_size, prev_len = sh->cap_len;
+    sh->cap_buf  = out;
+    sh->cap_size = out_size;
+    sh->cap_len  = 0;
+
+    size_t n = strlen(line);
+    if (n > sizeof buf - 1) {
+        st = SHELL_ERR_NO_SPACE;
+    } else {
+        memcpy(buf, line, n + 1);
+        st = line_is_blank(buf) ? SHELL_OK : run_line(sh, buf);
+    }
+
+    sh_flush(sh);
+    out[sh->cap_len < out_size - 1 ? sh->cap_len : out_size - 1] = '\0';
+    if (out_len) *out_len = sh->cap_len;
+    sh->cap_buf  = prev_buf;
+    sh->cap_size = prev_size;
+    sh->cap_len  = prev_len;
+    sh_unlock(sh);
+    return st;
+#else
+    (void)sh; (void)line; (void)out_len;
+    if (out && out_size) out[0] = '\0';
+    return SHELL_ERR_ARG;
+#endif
+}
+
+void shell_set_batch(shell_t *sh, bool on)
+{
+    if (!sh) return;
+    sh_lock(sh);
+    if (sh->batch != on) {
+        reset_line(sh);
+        sh->batch          = on;
+        sh->batch_cr       = false;
+        sh->batch_overflow = false;
+        sh->batch_line     = 0;
+        if (!on && sh->initial_prompt_shown)
+            sh_prompt(sh);
+        sh_flush(sh);
+    }
+    sh_unlock(sh);
+}
+
+void shell_set_abbrev(shell_t *sh, bool on)
+{
+#if SHELL_FEATURE_ABBREV
+    if (!sh) return;
+    sh_lock(sh);
+    sh->abbrev = on;
+    sh_unlock(sh);
+#else
+    (void)sh; (void)on;
+#endif
+}
+
+void shell_set_rpc(shell_t *sh, bool on)
+{
+#if SHELL_ENABLE_RPC
+    if (!sh) return;
+    sh_lock(sh);
+    if (sh->rpc != on && !sh->batch) {
+        if (on) {
+            rpc_enter(sh);
+        } else {
+            rpc_leave(sh);
+            sh_flush(sh);
         }
     }
+    sh_unlock(sh);
+#else
+    (void)sh; (void)on;
+#endif
+}
+
+bool shell_in_rpc(const shell_t *sh)
+{
+#if SHELL_ENABLE_RPC
+    return sh && sh->rpc;
+#else
+    (void)sh;
+    return false;
+#endif
+}
+
+int shell_last_status(const shell_t *sh)
+{
+    return sh ? sh->last_status : 0;
+}
+
+void shell_set_status_hook(shell_t *sh, shell_status_hook fn, void *ctx)
+{
+    if (!sh) return;
+    sh_lock(sh);
+    sh->status_hook = fn;
+    sh->status_ctx  = ctx;
+    sh_unlock(sh);
+}
+
+void shell_set_script_report(shell_t *sh, shell_script_report_fn fn, void *ctx)
+{
+    if (!sh) return;
+    sh_lock(sh);
+    sh->script_report = fn;
+    sh->script_ctx    = ctx;
+    sh_unlock(sh);
+}
+
+void shell_set_lock(shell_t *sh, shell_lock_func lock, shell_lock_func unlock, void *ctx)
+{
+    if (!sh) return;
+    sh->lock_f   = lock;
+    sh->unlock_f = unlock;
+    sh->lock_ctx = ctx;
 }
 
 void shell_set_complete(shell_t *sh, shell_complete_cb cb)
 {
+#if SHELL_FEATURE_COMPLETION
     if (!sh) return;
     sh->complete_cb = cb;
+#else
+    (void)sh; (void)cb;
+#endif
 }
 
 void shell_set_echo(shell_t *sh, bool enabled)
@@ -1076,57 +4795,286 @@ void shell_set_echo(shell_t *sh, bool enabled)
     sh->echo_enabled = enabled;
 }
 
-bool shell_get_echo(shell_t *sh)
+void shell_set_write(shell_t *sh, shell_write_func write_f)
 {
-    if (!sh) return false;
-    return sh->echo_enabled;
+    if (!sh) return;
+    sh_flush(sh);
+    sh->write_f = write_f;
 }
 
-void shell_run(shell_t *sh)
+void shell_flush(shell_t *sh)
 {
     if (!sh) return;
+    sh_flush(sh);
+}
 
-    /* Drain ISR queue first */
-    int ch = shell_dequeue_char(sh);
+size_t shell_write(shell_t *sh, const void *buf, size_t len)
+{
+    if (!sh || !buf) return 0;
+#if SHELL_TX_RING_SIZE > 0
+    if (SH_CAPTURING(sh)) {
+        /* The capture buffer never stalls: empty the ring into it, then
+         * go around it */
+        sh_tx_drain(sh, false);
+        sh_sink(sh, (const uint8_t *)buf, len);
+        return len;
+    }
+    if ((size_t)(SHELL_TX_RING_SIZE - sh->tx_len) < len)
+        sh_tx_drain(sh, false); /* Make what room the sink allows */
+    return sh_tx_put(sh, (const uint8_t *)buf, len);
+#else
+    sh_write(sh, (const char *)buf, len);
+    return len;
+#endif
+}
 
-    /* If queue empty, optionally poll user getchar (if provided) */
-    if (ch < 0 && sh->getc_f)
-        ch = sh->getc_f();
+int shell_printf(shell_t *sh, const char *fmt, ...)
+{
+    char buf[SHELL_PRINTF_BUF_SIZE];
+    va_list ap;
 
-    if (ch < 0)
-        return;
+    if (!sh || !fmt) return SHELL_WOULD_BLOCK;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof buf, fmt, ap);
+    va_end(ap);
+    if (n < 0) return 0;
+    if ((size_t)n > sizeof buf - 1) n = (int)(sizeof buf - 1);
+
+#if SHELL_TX_RING_SIZE > 0
+    if (!SH_CAPTURING(sh) && SHELL_TX_RING_SIZE - sh->tx_len < n) {
+        sh_tx_drain(sh, false);
+        if (SHELL_TX_RING_SIZE - sh->tx_len < n)
+            return SHELL_WOULD_BLOCK;
+    }
+#endif
+    return (int)shell_write(sh, buf, (size_t)n);
+}
+
+uint16_t shell_tx_space(const shell_t *sh)
+{
+#if SHELL_TX_RING_SIZE > 0
+    return sh ? (uint16_t)(SHELL_TX_RING_SIZE - sh->tx_len) : 0;
+#else
+    (void)sh;
+    return 0xFFFF;
+#endif
+}
+
+bool shell_get_echo(shell_t *sh)
+{
+    if (!sh) return false;
+    return sh->echo_enabled;
+}
+
+static void shell_process_char(shell_t *sh, int ch)
+{
+#if SHELL_ENABLE_METRICS
+    uint32_t out_before = sh->metrics.out_bytes;
+#endif
 
     /* First prompt: only if no login and not yet shown */
-    if (!sh->initial_prompt_shown && !sh->login_cb) {
+#if SHELL_FEATURE_LOGIN
+    if (!sh->initial_prompt_shown && !sh->login_cb && !sh->batch) {
         sh->logged_in = true;
+#else
+    if (!sh->initial_prompt_shown && !sh->batch) {
+#endif
         sh->initial_prompt_shown = true;
-        sh_prompt(sh);
+        sh_session_start(sh);
     }
 
+#if SHELL_FEATURE_LOGIN
     if (sh->login_cb && !sh->logged_in) {
         handle_login(sh, ch);
-        return;
+    } else
+#endif
+#if SHELL_ENABLE_RPC
+    if (sh->rpc) {
+        rpc_char(sh, (uint8_t)ch);
+    } else
+#endif
+    if (sh->batch) {
+        batch_char(sh, ch);
+    } else {
+#if SHELL_ENABLE_RPC
+        if (rpc_watch(sh, ch))
+            return;
+#endif
+        handle_line_char(sh, ch);
+#if SHELL_ENABLE_METRICS
+        uint32_t out = sh->metrics.out_bytes - out_before;
+        sh->metrics.key_events++;
+        sh->metrics.event_out_bytes += out;
+        if (out > sh->metrics.max_event_out)
+            sh->metrics.max_event_out = (uint16_t)(out > 0xFFFF ? 0xFFFF : out);
+#endif
+    }
+}
+
+uint16_t shell_run_budget(shell_t *sh, uint16_t max_bytes)
+{
+    if (!sh) return 0;
+
+    uint16_t used = 0;
+    sh_lock(sh);
+
+    if (sh->job_cmd)
+        job_poll_cancel(sh);
+
+    /* A byte polled while the last command ran goes first */
+    if (sh->getc_held && max_bytes > 0 && !sh->job_cmd) {
+        sh->getc_held = false;
+        shell_process_char(sh, sh->getc_byte);
+        used++;
     }
 
-    handle_line_char(sh, ch);
+    /* Drain ISR queue first; a command that goes resumable stops it */
+    while (used < max_bytes && !sh->job_cmd) {
+        int ch = shell_dequeue_char(sh);
+        if (ch < 0) break;
+        shell_process_char(sh, ch);
+        used++;
+    }
+
+    /* If queue empty, optionally poll user getchar (if provided) */
+    if (used == 0 && max_bytes > 0 && sh->getc_f && !sh->job_cmd) {
+        int ch = sh->getc_f();
+        if (ch >= 0) {
+            shell_process_char(sh, ch);
+            used++;
+        }
+    }
+
+    if (sh->job_cmd)
+        job_run(sh);
+
+    /* One transfer per call */
+    sh_flush(sh);
+    sh_unlock(sh);
+    return used;
+}
+
+void shell_run(shell_t *sh)
+{
+    shell_run_budget(sh, SHELL_RUN_BUDGET);
 }
 
 void shell_get_stats(shell_t *sh, shell_stats_t *out)
 {
     if (!sh || !out) return;
-    out->max_nodes_used = sh->art_max_used;
-    out->art_overflow   = sh->art_overflow;
+    memset(out, 0, sizeof *out);
+    const shell_cmdset_t *cs = sh->cmdset;
+    if (cs) {
+#if SHELL_FEATURE_ART
+        out->max_nodes_used = cs->art_max_used;
+        out->art_bytes_used = cs->art_used;
+        uint32_t flat = cs->art_flat_nodes * ART_FLAT_NODE_SIZE;
+        out->art_bytes_saved = flat > cs->art_used ? flat - cs->art_used : 0;
+        out->art_overflow = cs->art_overflow;
+        out->table_sorted = !cs->art && cs->sorted;
+#else
+        out->table_sorted = cs->sorted;
+#endif
+#if SHELL_DISPATCH_PHF
+        out->phf_active   = cs->phf_buckets != 0;
+#endif
+        out->cmd_count    = cs->cmd_count;
+    }
+#if SHELL_FEATURE_HISTORY
     out->history_count  = sh->history_count;
-    out->cmd_count      = sh->cmd_count;
+    out->history_bytes_used = sh->history_used;
+#endif
+#if SHELL_FEATURE_KEYBINDS
     out->keybind_count  = sh->keybind_count;
+#endif
+#if SHELL_ENABLE_METRICS
+    out->metrics        = sh->metrics;
+#endif
+}
+
+#if SHELL_ENABLE_METRICS
+void shell_set_metrics_clock(shell_t *sh, shell_clock_func now)
+{
+    if (!sh) return;
+    sh->metrics_clock = now;
+}
+
+bool shell_get_cmd_metrics(shell_t *sh, uint16_t index, shell_cmd_metrics_t *out)
+{
+    if (!sh || !out || index >= SHELL_METRICS_MAX_CMDS) return false;
+    if (!sh->cmdset || index >= sh->cmdset->cmd_count) return false;
+    *out = sh->cmd_metrics[index];
+    return true;
+}
+
+void shell_reset_metrics(shell_t *sh)
+{
+    if (!sh) return;
+    sh_lock(sh);
+    memset(&sh->metrics, 0, sizeof sh->metrics);
+    memset(sh->cmd_metrics, 0, sizeof sh->cmd_metrics);
+    sh_unlock(sh);
+}
+#endif
+
+int shell_cmd_stats(int argc, char **argv, void *user_data)
+{
+    shell_t *sh = (shell_t *)user_data;
+    shell_stats_t st;
+
+    (void)argc; (void)argv;
+    if (!sh) return 1;
+
+    shell_get_stats(sh, &st);
+    shell_printf(sh, "History: %u entries, %u / %u bytes\r\n",
+                 st.history_count, st.history_bytes_used, (unsigned)SHELL_HISTORY_BYTES);
+    shell_printf(sh, "Commands: %u, keybinds: %u / %u\r\n",
+                 st.cmd_count, st.keybind_count, (unsigned)SHELL_MAX_KEYBINDS);
+    shell_printf(sh, "ART: %u nodes, %u / %u bytes (%lu saved)%s\r\n",
+                 st.max_nodes_used, st.art_bytes_used, (unsigned)SHELL_ART_ARENA_SIZE,
+                 (unsigned long)st.art_bytes_saved, st.art_overflow ? ", OVERFLOW" : "");
+#if SHELL_ENABLE_METRICS
+    const shell_metrics_t *m = &st.metrics;
+    shell_printf(sh, "Input queue: high water %u / %u, %lu dropped\r\n",
+                 m->in_q_high_water, (unsigned)(SHELL_INPUT_QUEUE_SIZE - 1),
+                 (unsigned long)m->in_q_drops);
+    shell_printf(sh, "Key events: %lu, %lu bytes out (max %u per event)\r\n",
+                 (unsigned long)m->key_events, (unsigned long)m->event_out_bytes,
+                 m->max_event_out);
+    shell_printf(sh, "Output: %lu bytes, %lu redraws, %lu escape errors\r\n",
+                 (unsigned long)m->out_bytes, (unsigned long)m->redraws,
+                 (unsigned long)m->esc_errors);
+#if SHELL_TX_RING_SIZE > 0
+    shell_printf(sh, "TX stalls: %lu bytes dropped\r\n",
+                 (unsigned long)m->tx_drops);
+#endif
+
+    const shell_cmdset_t *cs = sh->cmdset;
+    uint16_t n = cs ? cs->cmd_count : 0;
+    if (n > SHELL_METRICS_MAX_CMDS) n = SHELL_METRICS_MAX_CMDS;
+    if (n)
+        shell_printf(sh, "%-16s %10s %10s %10s\r\n", "command", "calls", "total", "max");
+    for (uint16_t i = 0; i < n; i++) {
+        const shell_cmd_metrics_t *c = &sh->cmd_metrics[i];
+        if (!c->calls) continue;
+        shell_printf(sh, "%-16.16s %10lu %10lu %10lu\r\n", cs_cmd(cs, i)->name,
+                     (unsigned long)c->calls, (unsigned long)c->total_ticks,
+                     (unsigned long)c->max_ticks);
+    }
+#endif
+    return 0;
 }
 
 const char *shell_get_history_entry(shell_t *sh, uint16_t index)
 {
+#if SHELL_FEATURE_HISTORY
     if (!sh || index >= sh->history_count) {
         return NULL;
     }
-    int start = (sh->history_head + SHELL_HISTORY_SIZE - sh->history_count) % SHELL_HISTORY_SIZE;
-    int idx = (start + index) % SHELL_HISTORY_SIZE;
-    return sh->history[idx].line;
+    return hist_text(sh, hist_at(sh, index));
+#else
+    (void)sh; (void)index;
+    return NULL;
+#endif
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /*
@@ -19,14 +20,104 @@
 #define SHELL_MAX_ARGS          8
 #endif
 
-/* ART node pool size (increase if shell_load_table() reports overflow) */
+/* Feature switches: 0 removes both the code and the shell_t fields.
+ * The API stays; calls into a removed feature do nothing or fail. */
+#ifndef SHELL_FEATURE_LOGIN
+#define SHELL_FEATURE_LOGIN         1   /* shell_set_login() prompt */
+#endif
+#ifndef SHELL_FEATURE_HISTORY
+#define SHELL_FEATURE_HISTORY       1   /* Up/Down, Ctrl+R, history store */
+#endif
+#ifndef SHELL_FEATURE_KEYBINDS
+#define SHELL_FEATURE_KEYBINDS      1   /* shell_bind_key() table */
+#endif
+#ifndef SHELL_FEATURE_COMPLETION
+#define SHELL_FEATURE_COMPLETION    1   /* Tab completion */
+#endif
+#ifndef SHELL_FEATURE_KILL_RING
+#define SHELL_FEATURE_KILL_RING     1   /* Killed text kept for Ctrl+Y */
+#endif
+#ifndef SHELL_FEATURE_ART
+#define SHELL_FEATURE_ART           1   /* Trie dispatch; 0 = strcmp over the table */
+#endif
+#ifndef SHELL_FEATURE_ARGS
+#define SHELL_FEATURE_ARGS          1   /* Typed argument schemas per command */
+#endif
+#ifndef SHELL_FEATURE_GROUPS
+#define SHELL_FEATURE_GROUPS        1   /* Subcommand groups with their own set */
+#endif
+#ifndef SHELL_FEATURE_CAPTURE
+#define SHELL_FEATURE_CAPTURE       1   /* shell_exec_capture() into a buffer */
+#endif
+#ifndef SHELL_FEATURE_ABBREV
+#define SHELL_FEATURE_ABBREV        1   /* Unique prefixes, "Did you mean" */
+#endif
+#ifndef SHELL_FEATURE_WRAP
+#define SHELL_FEATURE_WRAP          1   /* Long lines edited across rows */
+#endif
+#ifndef SHELL_FEATURE_SPANS
+#define SHELL_FEATURE_SPANS         1   /* One set from several module tables */
+#endif
+
+/* ART sizing hint: roughly how many trie nodes you expect */
 #ifndef SHELL_ART_MAX_NODES
 #define SHELL_ART_MAX_NODES     128
 #endif
 
-/* Fixed children per ART node */
-#ifndef SHELL_ART_MAX_CHILDREN
-#define SHELL_ART_MAX_CHILDREN  16
+/* ART byte arena that Node4/16/48/256 nodes are carved from (max 32767;
+ * increase if shell_get_stats() reports overflow). Set to 0 to drop the
+ * arena entirely when only prebuilt tries are used. */
+#ifndef SHELL_ART_ARENA_SIZE
+#define SHELL_ART_ARENA_SIZE    (SHELL_ART_MAX_NODES * 24)
+#endif
+#if !SHELL_FEATURE_ART
+#undef  SHELL_ART_ARENA_SIZE
+#define SHELL_ART_ARENA_SIZE    0
+#endif
+
+/* Resolve argv[0] through a minimal perfect hash built at load time
+ * instead of walking the trie. The trie is then only used for completion. */
+#ifndef SHELL_DISPATCH_PHF
+#define SHELL_DISPATCH_PHF      0
+#endif
+
+/* Largest table the perfect hash is built for; bigger tables fall back
+ * to trie dispatch. Costs 2.5 bytes of RAM per command. */
+#ifndef SHELL_PHF_MAX_CMDS
+#define SHELL_PHF_MAX_CMDS      64
+#endif
+
+/* Most tables shell_load_spans() takes per set. Costs 2 bytes of RAM
+ * each in every shell_cmdset_t. */
+#ifndef SHELL_MAX_SPANS
+#define SHELL_MAX_SPANS         8
+#endif
+
+/* Give each shell_t its own command set, so shell_load_table() works on
+ * the session directly. Off by default: a set carries the whole trie
+ * arena and hash tables, so sessions attach a shared one with
+ * shell_set_cmdset() and N consoles build the trie once. */
+#ifndef SHELL_EMBED_CMDSET
+#define SHELL_EMBED_CMDSET      0
+#endif
+
+/* Set to 1 when shell_feed_char()/shell_feed_buf() run on another core
+ * than shell_run() (ESP32, RP2040, other SMP RTOSes). The queue then
+ * insists on real acquire/release atomics and fails the build if the
+ * compiler offers none. Single-core ISR producers don't need it. */
+#ifndef SHELL_SMP
+#define SHELL_SMP               0
+#endif
+
+/* "Did you mean" offers the closest name within this many edits
+ * (insert, delete, substitute, swap two), fewer for short words. Words
+ * longer than SHELL_SUGGEST_MAX_LEN get no suggestion; the search keeps
+ * (MAX_LEN + MAX_DIST + 1) * (MAX_LEN + 1) bytes of rows on the stack. */
+#ifndef SHELL_SUGGEST_MAX_DIST
+#define SHELL_SUGGEST_MAX_DIST  2
+#endif
+#ifndef SHELL_SUGGEST_MAX_LEN
+#define SHELL_SUGGEST_MAX_LEN   16
 #endif
 
 /* Input queue for ISR → shell. Must be power of two for fastest wrap. */
@@ -34,16 +125,113 @@
 #define SHELL_INPUT_QUEUE_SIZE  64
 #endif
 
-/* History buffer size (number of commands) */
+/* History sizing hint: roughly how many commands you expect to keep */
 #ifndef SHELL_HISTORY_SIZE
 #define SHELL_HISTORY_SIZE      8
 #endif
 
+/* History byte ring. Entries are packed as length + text + NUL + length
+ * and the oldest are evicted to make room, so short commands cost only a
+ * few bytes each. Must hold at least one full line (SHELL_LINEBUF_SIZE + 2,
+ * + 4 past 256); the default always fits one and then ~32 bytes per
+ * hinted entry. */
+#ifndef SHELL_HISTORY_BYTES
+#define SHELL_HISTORY_BYTES     (SHELL_HISTORY_SIZE * 32 + SHELL_LINEBUF_SIZE)
+#endif
+
+/* Longest Ctrl+R reverse-search string */
+#ifndef SHELL_SEARCH_MAX
+#define SHELL_SEARCH_MAX        32
+#endif
+
+/* Ask the terminal to bracket pastes (ESC[?2004h) when the session starts */
+#ifndef SHELL_BRACKETED_PASTE
+#define SHELL_BRACKETED_PASTE   1
+#endif
+
+/* Terminal width until one is set or reported. With 0 the line is
+ * drawn as if it never wraps, and completion lists use 80 columns. */
+#ifndef SHELL_TERM_COLS
+#define SHELL_TERM_COLS         0
+#endif
+
+/* Ask the terminal for its width with the first prompt (a cursor
+ * position report, see shell_query_term_width()) */
+#ifndef SHELL_TERM_QUERY
+#define SHELL_TERM_QUERY        1
+#endif
+
 /* Max custom key bindings */
 #ifndef SHELL_MAX_KEYBINDS
 #define SHELL_MAX_KEYBINDS      16
 #endif
 
+/* Steps a resumable command gets per shell_run() when no clock is set */
+#ifndef SHELL_JOB_STEPS
+#define SHELL_JOB_STEPS         1
+#endif
+
+/* Max input bytes shell_run() processes per call (see shell_run_budget) */
+#ifndef SHELL_RUN_BUDGET
+#define SHELL_RUN_BUDGET        SHELL_INPUT_QUEUE_SIZE
+#endif
+
+/* Output staging buffer. Output is collected here and flushed once per
+ * key event (or when full). Set to 0 to write every byte straight out. */
+#ifndef SHELL_OUTBUF_SIZE
+#define SHELL_OUTBUF_SIZE       64
+#endif
+
+/* Bounded TX ring (replaces the staging buffer when > 0). All output,
+ * including shell_write()/shell_printf() from handlers, is queued here
+ * and drained from shell_run() as fast as the sink accepts it; a full
+ * ring makes shell_write()/shell_printf() report "would block". With a
+ * ring, write_f may take fewer bytes than offered (0 = busy). */
+#ifndef SHELL_TX_RING_SIZE
+#define SHELL_TX_RING_SIZE      0
+#endif
+
+/* Sink calls in a row that take nothing before the shell gives up waiting
+ * for TX ring room and drops the rest of its own output (a disconnected
+ * USB-CDC port, say). Counted in shell_metrics_t.tx_drops. */
+#ifndef SHELL_TX_STALL_TRIES
+#define SHELL_TX_STALL_TRIES    1000
+#endif
+
+/* Longest single shell_printf() expansion (formatted on the stack) */
+#ifndef SHELL_PRINTF_BUF_SIZE
+#define SHELL_PRINTF_BUF_SIZE   128
+#endif
+
+/* Hot-path counters in shell_get_stats() and shell_cmd_stats() */
+#ifndef SHELL_ENABLE_METRICS
+#define SHELL_ENABLE_METRICS    0
+#endif
+
+/* Commands, by table index (or span id), that get call/time counters */
+#ifndef SHELL_METRICS_MAX_CMDS
+#define SHELL_METRICS_MAX_CMDS  16
+#endif
+
+/* Binary RPC mode: SHELL_RPC_MAGIC typed at the prompt switches the
+ * console from the line editor to CRC-checked frames (shell_set_rpc()) */
+#ifndef SHELL_ENABLE_RPC
+#define SHELL_ENABLE_RPC        0
+#endif
+
+/* Bytes that switch to RPC mode. The first is one no terminal sends,
+ * so typing at the prompt is never held back. */
+#ifndef SHELL_RPC_MAGIC
+#define SHELL_RPC_MAGIC         "\377RPC"
+#endif
+
+/* Largest request and reply payload. Requests are received into
+ * linebuf, so at most SHELL_LINEBUF_SIZE (and 255, the length byte);
+ * at least 3 for the info reply. */
+#ifndef SHELL_RPC_MAX_PAYLOAD
+#define SHELL_RPC_MAX_PAYLOAD   (SHELL_LINEBUF_SIZE < 64 ? SHELL_LINEBUF_SIZE : 64)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -69,7 +257,7 @@ typedef enum {
     SHELL_KEY_CTRL_P,       /* Previous history */
     SHELL_KEY_CTRL_U,       /* Kill line (from beginning to cursor) */
     SHELL_KEY_CTRL_W,       /* Kill word backwards */
-    SHELL_KEY_CTRL_R,       /* Reverse search (reserved) */
+    SHELL_KEY_CTRL_R,       /* Reverse incremental history search */
     SHELL_KEY_CTRL_T,       /* Transpose chars */
     SHELL_KEY_TAB,          /* Tab completion */
     SHELL_KEY_UP,
@@ -96,14 +284,136 @@ typedef enum {
     SHELL_KEY_F12,
     SHELL_KEY_BACKSPACE,
     SHELL_KEY_ENTER,
+    SHELL_KEY_CTRL_Y,       /* Yank the last killed text */
+    SHELL_KEY_CHAR = 0x80,  /* | a printable byte; only seen with SHELL_MOD_ALT */
 } shell_key_t;
 
+/* Modifier bits the escape decoder ORs onto a key, so ESC[1;5C
+ * arrives as SHELL_KEY_RIGHT | SHELL_MOD_CTRL and ESC b as
+ * SHELL_KEY_ALT('b'). Bind the combined value with shell_bind_key(). */
+#define SHELL_MOD_SHIFT         0x100
+#define SHELL_MOD_ALT           0x200
+#define SHELL_MOD_CTRL          0x400
+#define SHELL_KEY_MOD(k, m)     ((shell_key_t)((k) | (m)))
+#define SHELL_KEY_ALT(c)        ((shell_key_t)(SHELL_MOD_ALT | SHELL_KEY_CHAR | (c)))
+
 /* Forward declaration */
 struct shell;
+struct shell_cmdset;
 
 /* Command function signature */
 typedef void (*shell_cmd_fn)(int argc, char **argv, void *user_data);
 
+/* Command with an exit status: 0 is success, like a process. `&&`,
+ * `||` and `$?` see it; a plain shell_cmd_fn always counts as 0. */
+typedef int (*shell_cmd_run_fn)(int argc, char **argv, void *user_data);
+
+/* Status a line gets when its command is not in the table */
+#define SHELL_EXIT_NOT_FOUND    127
+
+/* Status when the words don't match the command's argument schema */
+#define SHELL_EXIT_USAGE        2
+
+/* Argument types of a command schema */
+typedef enum {
+    SHELL_ARG_STR = 0,  /* Any word -> .s */
+    SHELL_ARG_INT,      /* Decimal, 0x hex or 0 octal within [min, max] -> .i */
+    SHELL_ARG_HEX,      /* Hex with or without 0x, at most max if set -> .u */
+    SHELL_ARG_ENUM,     /* One of choices[] -> .u is its index */
+    SHELL_ARG_FLAG,     /* The word `name` itself, anywhere on the line -> .b */
+} shell_arg_type_t;
+
+/*
+ * One schema entry. Positionals are matched in order (flags are
+ * skipped); only trailing ones may be optional. Completion offers the
+ * choices of an ENUM in the position being typed and the flags not yet
+ * on the line.
+ */
+typedef struct {
+    const char         *name;     /* Usage label; for a FLAG the word, e.g. "-v" */
+    uint8_t             type;     /* shell_arg_type_t */
+    bool                optional;
+    int32_t             min, max; /* INT: range, min == max allows any; HEX: max, 0 = any */
+    const char *const  *choices;  /* ENUM: NULL-terminated, scanned in order */
+} shell_arg_spec_t;
+
+typedef union {
+    int32_t     i;
+    uint32_t    u;
+    bool        b;
+    const char *s;
+} shell_arg_t;
+
+/* Converted arguments: v[n] belongs to schema entry n */
+typedef struct {
+    int          argc;
+    char       **argv;
+    uint32_t     given;     /* Bit n set if entry n was on the line */
+    shell_arg_t  v[SHELL_MAX_ARGS];
+} shell_args_t;
+
+#define SHELL_ARG_GIVEN(a, n)   ((((a)->given) >> (n)) & 1u)
+
+/* Command that takes its arguments already checked and converted */
+typedef int (*shell_cmd_args_fn)(const shell_args_t *args, void *user_data);
+
+/*
+ * RPC frames (SHELL_ENABLE_RPC), multi-byte fields little-endian:
+ *
+ *   request: [0xA5][seq][id lo][id hi][len][payload...][crc lo][crc hi]
+ *   reply:   [0xA5][seq][status][len][payload...][crc lo][crc hi]
+ *
+ * id is the command's index in the table (with spans, the span's base
+ * plus the index in its own table), seq is echoed back, and the crc is
+ * CRC-16/CCITT (0x1021, init 0xFFFF) over everything between 0xA5 and
+ * the crc. Bytes outside a frame are ignored, so a host that
+ * lost sync can send 261 zero bytes, which end any frame in progress,
+ * and then drop what arrives before its next reply.
+ */
+#define SHELL_RPC_SOF           0xA5
+#define SHELL_RPC_ID_EXIT       0xFFFF  /* Reply, then back to the prompt */
+#define SHELL_RPC_ID_INFO       0xFFFE  /* Empty: [count lo][count hi][max payload];
+                                         * [id lo][id hi]: that command's name */
+
+/* Reply statuses the shell uses itself; commands return 0..0xEF */
+#define SHELL_RPC_E_CRC         0xF0    /* Bad crc; nothing ran */
+#define SHELL_RPC_E_LENGTH      0xF1    /* Payload over SHELL_RPC_MAX_PAYLOAD */
+#define SHELL_RPC_E_NO_RPC      0xF2    /* The command has no rpc handler */
+/* An id past the table gets SHELL_EXIT_NOT_FOUND */
+
+/* Binary command for RPC mode: reads the request payload, writes at
+ * most *resp_len reply bytes to resp and sets *resp_len to the count.
+ * Returns the reply status. */
+typedef int (*shell_cmd_rpc_fn)(const uint8_t *req, size_t len,
+                                uint8_t *resp, size_t *resp_len, void *user_data);
+
+/* Result of one step of a resumable command */
+typedef enum {
+    SHELL_STEP_DONE = 0,    /* Finished; the prompt comes back */
+    SHELL_STEP_CONTINUE     /* Call again from the next shell_run() */
+} shell_step_t;
+
+/* A running resumable command, handed to each of its steps */
+typedef struct {
+    int       argc;
+    char    **argv;         /* Stays valid until the command is done */
+    void     *user_data;
+    uint32_t  calls;        /* Steps completed so far (0 on the first) */
+    uint32_t  state;        /* Free for the command; starts at 0 */
+    bool      cancel;       /* Ctrl+C was pressed: wrap up and return DONE */
+    struct shell *sh;       /* Session running it, for shell_printf() */
+    int       status;       /* Exit status once DONE; starts at 0 */
+#if SHELL_FEATURE_ARGS
+    const shell_args_t *args; /* Converted arguments, NULL without a schema */
+#endif
+} shell_job_t;
+
+/* Resumable command: do a bounded slice of work per call */
+typedef shell_step_t (*shell_cmd_step_fn)(shell_job_t *job);
+
+/* Monotonic tick source for step time slices (any unit, may wrap) */
+typedef uint32_t (*shell_clock_func)(void);
+
 /* Key event handler signature */
 typedef bool (*shell_key_handler)(struct shell *sh, shell_key_t key, void *user_data);
 
@@ -113,8 +423,41 @@ typedef struct {
     const char   *desc;
     shell_cmd_fn  fn;
     void         *user_data;
+    shell_cmd_step_fn step; /* Optional; if set, runs instead of fn */
+    shell_cmd_run_fn  run;  /* Optional; if set, runs instead of fn */
+#if SHELL_FEATURE_ARGS
+    const shell_arg_spec_t *args; /* Optional schema, checked before dispatch */
+    uint8_t           nargs;
+    shell_cmd_args_fn typed; /* Optional; if set, runs instead of run/fn */
+#endif
+#if SHELL_FEATURE_GROUPS
+    const struct shell_cmdset *sub; /* Optional group: argv[1] is looked up here */
+#endif
+#if SHELL_ENABLE_RPC
+    shell_cmd_rpc_fn  rpc;  /* Optional; what RPC frames with this index run */
+#endif
 } shell_ext_cmd_t;
 
+/* Table entry for an int-returning command */
+#define SHELL_CMD(n, d, r, u) \
+    { .name = (n), .desc = (d), .fn = NULL, .user_data = (u), .step = NULL, .run = (r) }
+
+/* Table entry for a command with a schema array and typed handler */
+#define SHELL_CMD_ARGS(n, d, spec, t, u) \
+    { .name = (n), .desc = (d), .user_data = (u), .args = (spec), \
+      .nargs = (uint8_t)(sizeof(spec) / sizeof((spec)[0])), .typed = (t) }
+
+/* Table entry for a group: "name sub ..." runs sub from the set, with
+ * argv[0] = "sub". A group with no handler of its own prints its usage. */
+#define SHELL_CMD_GROUP(n, d, set) \
+    { .name = (n), .desc = (d), .sub = (set) }
+
+/* One module's table, for shell_load_spans() */
+typedef struct {
+    const shell_ext_cmd_t *table;
+    uint16_t               count;
+} shell_cmd_span_t;
+
 /* Key binding descriptor */
 typedef struct {
     shell_key_t        key;
@@ -125,6 +468,30 @@ typedef struct {
 /* I/O callbacks */
 typedef int  (*shell_putchar_func)(int ch);
 typedef int  (*shell_getchar_func)(void); /* only used in "poll" mode, you can pass NULL */
+typedef int  (*shell_write_func)(const uint8_t *buf, size_t len); /* optional bulk sink */
+
+/*
+ * Persistent history backend (flash page, EEPROM, file...). The shell
+ * keeps an append-only log of records in a region of `size` bytes:
+ *
+ *   read:   copy len bytes at off into buf
+ *   append: program len bytes at off. off is always past the last record,
+ *           in space erased since; byte granularity (buffer in the backend
+ *           if the medium has a larger program unit)
+ *   erase:  erase the whole region; must read back as 0xFF afterwards
+ *
+ * All return 0 on success, negative on failure.
+ */
+typedef struct {
+    int    (*read)(void *ctx, uint32_t off, void *buf, size_t len);
+    int    (*append)(void *ctx, uint32_t off, const void *buf, size_t len);
+    int    (*erase)(void *ctx);
+    uint32_t size;
+    void    *ctx;
+} shell_history_store_t;
+
+/* Lock hooks for shell_set_lock(), e.g. a mutex take/give */
+typedef void (*shell_lock_func)(void *ctx);
 
 /* Login callback */
 typedef bool (*shell_login_cb)(const char *user, const char *pass);
@@ -139,44 +506,140 @@ typedef enum {
     SHELL_ERR_ARG,
     SHELL_ERR_NO_SPACE,
     SHELL_ERR_ART_OVERFLOW,
+    SHELL_ERR_NOT_FOUND,    /* Unknown command */
+    SHELL_ERR_BUSY,         /* A resumable command is running */
+    SHELL_ERR_FAILED,       /* The line's last command returned non-zero */
 } shell_status_t;
 
+/* Called with the exit status after each command line completes */
+typedef void (*shell_status_hook)(struct shell *sh, int status, void *ctx);
+
+/* Batch/script result for one line, numbered from 1 */
+typedef void (*shell_script_report_fn)(uint16_t line, shell_status_t status,
+                                       void *ctx);
+
+/* Hot-path counters (SHELL_ENABLE_METRICS) */
+typedef struct {
+    uint16_t in_q_high_water;   /* Deepest the input queue got */
+    uint32_t in_q_drops;        /* Bytes refused because it was full */
+    uint32_t key_events;        /* Input bytes handled by the editor */
+    uint32_t event_out_bytes;   /* Output while handling them */
+    uint16_t max_event_out;     /* Most output from a single one */
+    uint32_t out_bytes;         /* All output, commands included */
+    uint32_t redraws;           /* Full line redraws */
+    uint32_t esc_errors;        /* Aborted or unrecognised sequences */
+    uint32_t tx_drops;          /* Shell output lost to a stalled sink */
+} shell_metrics_t;
+
+/* Per-command counters, in shell_set_metrics_clock() ticks. For step
+ * commands every step adds to total_ticks and max_ticks is the longest
+ * single step. */
+typedef struct {
+    uint32_t calls;
+    uint32_t total_ticks;
+    uint32_t max_ticks;
+} shell_cmd_metrics_t;
+
 /* Stats you can query at runtime */
 typedef struct {
     uint16_t max_nodes_used;
-    bool     art_overflow;
+    uint16_t art_bytes_used;
+    uint32_t art_bytes_saved; /* vs. one Node4 per character, from path compression */
+    bool     phf_active;      /* argv[0] is dispatched through the perfect hash */
+    bool     art_overflow;    /* The trie didn't fit; the table is used instead */
+    bool     table_sorted;    /* Without a trie, the table is binary searched */
     uint16_t history_count;
+    uint16_t history_bytes_used; /* of SHELL_HISTORY_BYTES */
     uint16_t cmd_count;
     uint8_t  keybind_count;
+#if SHELL_ENABLE_METRICS
+    shell_metrics_t metrics;
+#endif
 } shell_stats_t;
 
 /* Escape state (internal) */
 typedef struct {
     uint8_t  state;
     uint8_t  num_params;
+    uint8_t  flags;         /* Alt prefix / private marker seen */
+    bool     paste;         /* Inside ESC[200~ ... ESC[201~ */
+    uint16_t paste_at;      /* Cursor when the paste started */
     uint16_t params[4];
 } shell_esc_t;
 
-/* ART node (internal) */
-typedef struct shell_art_node {
-    uint8_t  n_children;
-    uint8_t  key;
-    int16_t  cmd_idx;
-    int16_t  child_idx[SHELL_ART_MAX_CHILDREN];
-    uint8_t  child_key[SHELL_ART_MAX_CHILDREN];
-} shell_art_node_t;
-
-/* History entry */
+/* Const trie emitted by tools/shell_trie_gen (lives in flash).
+ * The arena uses the same byte layout as the RAM one, so it is
+ * independent of the target's endianness and struct padding. */
 typedef struct {
-    char line[SHELL_LINEBUF_SIZE];
-} shell_history_entry_t;
+    const uint8_t *arena;
+    uint16_t       size;
+    uint16_t       root;        /* Byte offset of the root node */
+    uint16_t       node_count;
+    uint16_t       cmd_count;   /* Entries in the matching table */
+} shell_art_prebuilt_t;
+
+/*
+ * Command set: the table, its trie and (optionally) the perfect hash.
+ * Read-only once loaded, so one set can serve any number of sessions.
+ * The per-node subtree counts and name lengths in the trie double as the
+ * completion index. A group entry's sub points at another set, so a
+ * hierarchy is a tree of sets, each with a trie of one level's names.
+ */
+typedef struct shell_cmdset {
+    const shell_ext_cmd_t *cmd_table;
+    uint16_t               cmd_count;
+    bool                   sorted;  /* Names in strcmp order: binary search */
+#if SHELL_FEATURE_SPANS
+    const shell_cmd_span_t *spans;  /* NULL: cmd_table is the only table */
+    uint8_t                span_count;
+    uint16_t               span_base[SHELL_MAX_SPANS]; /* Id of each span's first entry */
+#endif
+
+#if SHELL_FEATURE_ART
+    /* ART/trie */
+    const uint8_t   *art;          /* Active arena: art_arena or a prebuilt one */
+#if SHELL_ART_ARENA_SIZE > 0
+    uint8_t          art_arena[SHELL_ART_ARENA_SIZE];
+    uint16_t         art_free_list[4]; /* Recycled nodes, per node class */
+#endif
+    uint16_t         art_root;     /* Byte offset of the root node */
+    uint16_t         art_used;     /* Arena bump pointer */
+    uint32_t         art_flat_nodes; /* Nodes an uncompressed trie would need */
+#endif
+
+#if SHELL_DISPATCH_PHF
+    /* Perfect hash: bucket -> displacement, slot -> command index */
+    uint16_t         phf_disp[(SHELL_PHF_MAX_CMDS + 3) / 4];
+    uint16_t         phf_map[SHELL_PHF_MAX_CMDS];
+    uint16_t         phf_buckets;  /* 0 = not built */
+    uint8_t          phf_salt;
+#endif
+
+#if SHELL_FEATURE_ART
+    /* Stats */
+    uint16_t         art_max_used; /* Live nodes */
+    bool             art_overflow;
+#endif
+} shell_cmdset_t;
 
 /* Main shell struct – you allocate this (on stack/BSS) */
 typedef struct shell {
     /* I/O */
     shell_putchar_func putc_f;
     shell_getchar_func getc_f;
+    shell_write_func   write_f;
 
+    /* Output staging */
+#if SHELL_TX_RING_SIZE > 0
+    uint8_t        tx_ring[SHELL_TX_RING_SIZE];
+    uint16_t       tx_tail;     /* Next byte to hand to the sink */
+    uint16_t       tx_len;      /* Bytes queued */
+#elif SHELL_OUTBUF_SIZE > 0
+    uint8_t        outbuf[SHELL_OUTBUF_SIZE];
+    uint16_t       out_len;
+#endif
+
+#if SHELL_FEATURE_LOGIN
     /* Login */
     shell_login_cb login_cb;
     char           login_trigger;
@@ -185,55 +648,147 @@ typedef struct shell {
     char           login_user[SHELL_LINEBUF_SIZE];
     char           login_pass[SHELL_LINEBUF_SIZE];
     uint16_t       login_idx;
+#endif
 
     /* Line editing */
     char           linebuf[SHELL_LINEBUF_SIZE];
     uint16_t       line_len;
     uint16_t       cursor_pos;
+#if SHELL_FEATURE_KILL_RING
     char           killed_text[SHELL_LINEBUF_SIZE];  /* For yank/kill operations */
+#endif
     uint8_t        prompt_len;
 
-    /* External command table */
-    const shell_ext_cmd_t *cmd_table;
-    uint16_t               cmd_count;
-
-    /* ART/trie */
-    shell_art_node_t art_nodes[SHELL_ART_MAX_NODES];
-    int16_t          art_root;
-    uint16_t         art_free;
+    /* What the terminal currently shows after the prompt */
+    uint16_t       term_len;
+    uint16_t       term_cursor;
+#if SHELL_FEATURE_WRAP
+    uint16_t       term_cols;     /* Wrap width, 0 = unknown (one row) */
+    bool           term_query;    /* Width report asked for, not seen yet */
+#endif
 
-    /* Stats */
-    uint16_t         art_max_used;
-    bool             art_overflow;
+    /* Commands: cmdset_own, or a set shared between sessions */
+    const shell_cmdset_t *cmdset;
+#if SHELL_EMBED_CMDSET
+    shell_cmdset_t        cmdset_own;
+#endif
 
     /* Escape parsing */
     shell_esc_t      esc;
 
+#if SHELL_FEATURE_HISTORY
     /* History */
-    shell_history_entry_t history[SHELL_HISTORY_SIZE];
-    uint8_t               history_head;    /* Next slot to write */
-    uint8_t               history_count;   /* Total entries (max SHELL_HISTORY_SIZE) */
-    int8_t                history_pos;     /* Current position in history (-1 = not browsing) */
+    uint8_t               history[SHELL_HISTORY_BYTES]; /* Packed entry ring */
+    uint16_t              history_tail;    /* Offset of the oldest entry */
+    uint16_t              history_head;    /* Offset the next entry is written at */
+    uint16_t              history_last;    /* Offset of the newest entry */
+    uint16_t              history_used;    /* Bytes held by live entries */
+    uint16_t              history_count;   /* Live entries */
+    int16_t               history_pos;     /* Entry being browsed, 0 = oldest (-1 = not browsing) */
+    uint16_t              history_off;     /* Offset of history_pos's entry */
+    uint16_t              history_wrap;    /* End of the entries before offset 0 */
     char                  history_saved[SHELL_LINEBUF_SIZE]; /* Saved current line when browsing */
 
+    const shell_history_store_t *history_store;
+    uint32_t              history_store_off; /* Log write offset */
+
+    /* Ctrl+R reverse search; the match is browsed through history_pos */
+    bool                  search_active;
+    uint8_t               search_len;
+    char                  search_query[SHELL_SEARCH_MAX];
+#endif
+
+#if SHELL_FEATURE_KEYBINDS
     /* Key bindings */
     shell_keybind_t  keybinds[SHELL_MAX_KEYBINDS];
     uint8_t          keybind_count;
+#endif
 
+#if SHELL_FEATURE_COMPLETION
     /* Tab completion */
     shell_complete_cb complete_cb;
+#endif
 
     /* Single-producer/single-consumer input queue */
     uint8_t          in_q[SHELL_INPUT_QUEUE_SIZE];
     volatile uint16_t in_head;   /* producer (ISR) writes head */
     volatile uint16_t in_tail;   /* consumer (main) writes tail */
 
+    /* Resumable command in progress; argv points into linebuf */
+    shell_job_t      job;
+    const shell_ext_cmd_t *job_cmd; /* NULL when idle */
+    bool             getc_held;  /* getc_f byte polled during a job, not queued */
+    uint8_t          getc_byte;
+    char            *job_argv[SHELL_MAX_ARGS + 1];
+#if SHELL_FEATURE_ARGS
+    shell_args_t     job_args;
+#endif
+    shell_clock_func clock_f;
+    uint32_t         job_slice;
+
+    /* Optional lock, see shell_set_lock() */
+    shell_lock_func  lock_f;
+    shell_lock_func  unlock_f;
+    void            *lock_ctx;
+
+    /* Command chains (a; b && c || d) and their exit status */
+    char            *chain_next;      /* Rest of a chain behind a running job */
+    char             chain_op;
+    int              last_status;     /* $? */
+    char             status_str[12];  /* $? as an argument */
+    shell_status_hook status_hook;
+    void            *status_ctx;
+
+    /* Batch mode: lines run without echo, prompt or history */
+    bool             batch;
+    bool             batch_cr;        /* Swallow the \n of a CR LF */
+    bool             batch_overflow;  /* Current line was cut short */
+    uint16_t         batch_line;
+    shell_script_report_fn script_report;
+    void            *script_ctx;
+
+#if SHELL_FEATURE_CAPTURE
+    /* shell_exec_capture(): output lands here instead of the sink */
+    char            *cap_buf;
+    size_t           cap_size;
+    size_t           cap_len;         /* Produced so far, kept or not */
+#endif
+
+#if SHELL_FEATURE_ABBREV
+    bool             abbrev;          /* Unique prefixes run, see shell_set_abbrev() */
+#endif
+
+#if SHELL_ENABLE_RPC
+    /* RPC mode: frames instead of the line editor; payload in linebuf */
+    bool             rpc;
+    uint8_t          rpc_magic;      /* Magic bytes matched at the prompt */
+    uint8_t          rpc_state;      /* Frame field expected next */
+    uint8_t          rpc_seq;
+    uint8_t          rpc_len;
+    uint8_t          rpc_got;        /* Payload bytes received */
+    uint8_t          rpc_crc_lo;
+    uint16_t         rpc_id;
+    uint16_t         rpc_crc;        /* Running crc of the frame */
+#endif
+
+#if SHELL_ENABLE_METRICS
+    shell_metrics_t     metrics;
+    shell_cmd_metrics_t cmd_metrics[SHELL_METRICS_MAX_CMDS];
+    shell_clock_func    metrics_clock;
+#endif
+
     /* Flags */
     bool             echo_enabled;
     bool             initial_prompt_shown;
 
 } shell_t;
 
+/* A shell_t is one console session: line buffer, escape state, input
+ * queue, history and output staging. With SHELL_EMBED_CMDSET=0 (the
+ * default) it holds only a pointer to the shell_cmdset_t it runs, so
+ * each extra console costs sizeof(shell_t) and no trie. */
+typedef struct shell shell_session_t;
+
 /*
  * ===========================
  * API
@@ -250,15 +805,222 @@ shell_status_t shell_init(shell_t              *sh,
                           shell_getchar_func     getc_f);
 
 /**
- * Load an external, static command table and build the trie.
+ * Load an external, static command table and build the trie into the
+ * session's own command set (SHELL_EMBED_CMDSET). If the arena runs
+ * out, the set keeps working without the trie, like
+ * shell_load_sorted() for a sorted table or one strcmp per entry
+ * otherwise, and shell_get_stats() reports art_overflow.
  * Returns:
- * - SHELL_OK on success
- * - SHELL_ERR_ART_OVERFLOW if there weren't enough nodes
+ * - SHELL_OK on success, with or without the trie
+ * - SHELL_ERR_NO_SPACE without an embedded set (the default): load a
+ *   shell_cmdset_t with shell_cmdset_load_table() and attach it with
+ *   shell_set_cmdset()
  */
 shell_status_t shell_load_table(shell_t *sh,
                                 const shell_ext_cmd_t *table,
                                 uint16_t count);
 
+/**
+ * Set an optional bulk output sink. When set, staged output is handed
+ * over in one call per flush instead of one putc_f call per byte.
+ * Pass NULL to go back to putc_f.
+ */
+void shell_set_write(shell_t *sh, shell_write_func write_f);
+
+/* shell_printf(): output did not fit, nothing was queued. shell_write()
+ * reports the same condition by returning 0. */
+#define SHELL_WOULD_BLOCK       (-1)
+
+/**
+ * Queue output from a command handler, in order with the shell's own.
+ * With SHELL_TX_RING_SIZE, takes as much as fits and returns that count
+ * (0 when the ring is full: yield, e.g. return SHELL_STEP_CONTINUE, and
+ * retry). Without a ring the bytes go straight out and len is returned.
+ */
+size_t shell_write(shell_t *sh, const void *buf, size_t len);
+
+/**
+ * printf into the shell's output. All or nothing: returns the number of
+ * bytes queued, or SHELL_WOULD_BLOCK if the TX ring lacks room for the
+ * whole expansion. Output longer than SHELL_PRINTF_BUF_SIZE - 1 is cut.
+ */
+int shell_printf(shell_t *sh, const char *fmt, ...)
+#if defined(__GNUC__) || defined(__clang__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+
+/** Free bytes in the TX ring (0xFFFF without a ring) */
+uint16_t shell_tx_space(const shell_t *sh);
+
+/**
+ * Flush staged output to the sink. shell_run() does this after every
+ * key event; call it yourself if you emit output outside of shell_run().
+ * With a TX ring it only hands over what the sink takes without waiting.
+ */
+void shell_flush(shell_t *sh);
+
+/**
+ * Use a trie generated at build time (see tools/shell_trie_gen) instead of
+ * building one in RAM. Lookup and completion run straight from the const
+ * nodes, so no node pool is needed.
+ * Returns:
+ * - SHELL_OK on success
+ * - SHELL_ERR_ARG if the trie doesn't match the table's entry count
+ * With SHELL_FEATURE_ART=0 the trie is ignored and names are matched
+ * against the table.
+ */
+shell_status_t shell_load_prebuilt_trie(shell_t *sh,
+                                        const shell_ext_cmd_t *table,
+                                        uint16_t count,
+                                        const shell_art_prebuilt_t *trie);
+
+/**
+ * Use a table sorted by name (strcmp order) as is: lookup and completion
+ * binary search it, and no trie is built. Loading is one pass that
+ * checks the order, so big tables cost nothing at boot and no arena.
+ * Returns:
+ * - SHELL_OK on success
+ * - SHELL_ERR_ARG if the names are not strictly ascending
+ */
+shell_status_t shell_load_sorted(shell_t *sh,
+                                 const shell_ext_cmd_t *table,
+                                 uint16_t count);
+
+/**
+ * Build a command set that several sessions can share. Same results as
+ * shell_load_table() / shell_load_prebuilt_trie(); the set must stay
+ * untouched while sessions are attached to it.
+ */
+shell_status_t shell_cmdset_load_table(shell_cmdset_t *cs,
+                                       const shell_ext_cmd_t *table,
+                                       uint16_t count);
+
+shell_status_t shell_cmdset_load_prebuilt_trie(shell_cmdset_t *cs,
+                                               const shell_ext_cmd_t *table,
+                                               uint16_t count,
+                                               const shell_art_prebuilt_t *trie);
+
+shell_status_t shell_cmdset_load_sorted(shell_cmdset_t *cs,
+                                        const shell_ext_cmd_t *table,
+                                        uint16_t count);
+
+/**
+ * Load several tables into one set, e.g. one per module, without first
+ * merging them into one array. Spans are numbered in order: a command's
+ * id, as used by RPC frames and shell_get_cmd_metrics(), is the count of
+ * all earlier spans plus its index in its own table. The trie and hash
+ * are built over all of them as by shell_load_table(); a name in a later
+ * span shadows the same name in an earlier one. When every span is
+ * sorted by name, lookups without the trie (arena overflow, or
+ * SHELL_FEATURE_ART=0) binary search each span instead of scanning.
+ * spans[] and the tables must stay valid while loaded.
+ * Returns:
+ * - SHELL_OK on success
+ * - SHELL_ERR_ARG for a NULL table or more than 0xFFFE commands in all
+ * - SHELL_ERR_NO_SPACE for more than SHELL_MAX_SPANS spans, or more
+ *   than one without SHELL_FEATURE_SPANS
+ */
+shell_status_t shell_load_spans(shell_t *sh, const shell_cmd_span_t *spans, uint8_t n);
+
+shell_status_t shell_cmdset_load_spans(shell_cmdset_t *cs,
+                                       const shell_cmd_span_t *spans, uint8_t n);
+
+/**
+ * Point a session at a (shared) command set instead of its own.
+ * With SHELL_EMBED_CMDSET, shell_load_table() switches it back.
+ */
+void shell_set_cmdset(shell_t *sh, const shell_cmdset_t *cs);
+
+/**
+ * Let a word that starts exactly one command name run it, e.g. `sta`
+ * for `stats`, at the top level and inside groups. An exact name always
+ * wins; an ambiguous prefix still fails and says how many it matched.
+ * Off by default, since adding a command can take a prefix away from
+ * scripts. Does nothing without SHELL_FEATURE_ABBREV.
+ */
+void shell_set_abbrev(shell_t *sh, bool on);
+
+/**
+ * Time-slice resumable commands: each shell_run() keeps stepping the
+ * running command until `slice` ticks of `now` have passed (at least one
+ * step). Without a clock it gets SHELL_JOB_STEPS steps per call.
+ */
+void shell_set_clock(shell_t *sh, shell_clock_func now, uint32_t slice);
+
+/**
+ * True while a resumable command is running. Input waits in the queue
+ * meanwhile; a Ctrl+C in it sets job->cancel. With a getc_f, each
+ * shell_run() still polls it once: Ctrl+C cancels the command, and one
+ * other byte is held back as typeahead (later ones are dropped until
+ * the command is done).
+ */
+bool shell_is_busy(const shell_t *sh);
+
+/**
+ * Run a script of newline-separated command lines (CR LF is fine).
+ * There is no echo, prompt, redraw or history; blank lines and lines
+ * starting with '#' are skipped. Resumable commands are stepped to
+ * completion before the next line. Each line's status goes to the
+ * shell_set_script_report() callback, or is printed as
+ * "<line>: <error>" when failed and no callback is set.
+ * Returns:
+ * - SHELL_OK if every line ran
+ * - the status of the first failing line otherwise
+ *   (SHELL_ERR_NOT_FOUND, SHELL_ERR_FAILED for a non-zero exit status,
+ *   or SHELL_ERR_NO_SPACE for an overlong line)
+ * - SHELL_ERR_BUSY if a resumable command is running
+ */
+shell_status_t shell_exec_script(shell_t *sh, const char *buf, size_t len);
+
+/**
+ * Run one command line like shell_exec_script() and collect what it
+ * prints through the shell (its messages, shell_write(), shell_printf())
+ * in out instead of the console, e.g. to answer a remote request in one
+ * packet. Output the console had staged goes out first. out is always
+ * NUL-terminated; *out_len (may be NULL) gets the bytes produced, more
+ * than out_size - 1 if some were cut. Unlike a script, "Command not
+ * found" and usage errors are part of the output.
+ * Returns what shell_exec_script() would for the line, or SHELL_ERR_ARG
+ * without SHELL_FEATURE_CAPTURE.
+ */
+shell_status_t shell_exec_capture(shell_t *sh, const char *line,
+                                  char *out, size_t out_size, size_t *out_len);
+
+/**
+ * Batch mode for input fed through shell_feed_char()/shell_run():
+ * every CR or LF terminated line runs as in shell_exec_script(), with
+ * lines numbered from when batch mode was turned on. Turning it off
+ * brings the prompt back.
+ */
+void shell_set_batch(shell_t *sh, bool on);
+
+/**
+ * Exit status of the last command that ran ($?). A command line may
+ * chain commands with `;`, `&&` (run if the previous one returned 0)
+ * and `||` (run if it did not); an argument of exactly `$?` is replaced
+ * by the status so far.
+ */
+int shell_last_status(const shell_t *sh);
+
+/** Hook called with the final status after each command line */
+void shell_set_status_hook(shell_t *sh, shell_status_hook fn, void *ctx);
+
+/** Per-line status callback for shell_exec_script() and batch mode */
+void shell_set_script_report(shell_t *sh, shell_script_report_fn fn, void *ctx);
+
+/**
+ * Switch the console between the line editor and RPC frames (see
+ * SHELL_RPC_SOF) without the magic, e.g. when a host times out.
+ * Frames run the table entry's rpc handler directly: no echo, prompt,
+ * argv or text parsing. Leaving brings the prompt back.
+ * Does nothing without SHELL_ENABLE_RPC.
+ */
+void shell_set_rpc(shell_t *sh, bool on);
+
+/** True while the console speaks RPC frames */
+bool shell_in_rpc(const shell_t *sh);
+
 /** Enable login; user must type the trigger char first, e.g. '#' */
 void shell_set_login(shell_t *sh,
                      shell_login_cb cb,
@@ -273,18 +1035,83 @@ void shell_logout(shell_t *sh);
  */
 bool shell_feed_char(shell_t *sh, uint8_t ch);
 
+/**
+ * Feed a block of characters (ISR/DMA-safe single producer).
+ * Copies as much as fits in one shot and publishes it at once.
+ * Returns the number of bytes accepted; anything short of len was not
+ * queued and should be retried later (backpressure).
+ */
+uint16_t shell_feed_buf(shell_t *sh, const uint8_t *buf, uint16_t len);
+
+/**
+ * Concurrency model:
+ * - shell_feed_char()/shell_feed_buf() are lock-free and may run in one
+ *   ISR or task (one producer), concurrently with shell_run() on another
+ *   core. Build with SHELL_SMP=1 on SMP targets.
+ * - With a lock set here, shell_load_table(), shell_load_prebuilt_trie(),
+ *   shell_set_cmdset(), shell_bind_key(), shell_unbind_key() and
+ *   shell_add_history() take it, and so does shell_run() while it works.
+ *   Other tasks can then inject commands and history at any time.
+ * - The lock is released around command, key binding and completion
+ *   callbacks, so those may call the functions above; a non-recursive
+ *   mutex is enough.
+ * - Everything else (output, line editing, getters) belongs to the task
+ *   that calls shell_run().
+ * Pass NULL hooks to disable locking.
+ */
+void shell_set_lock(shell_t *sh, shell_lock_func lock, shell_lock_func unlock, void *ctx);
+
 /**
  * Process pending characters and run commands.
  * Call this often from your main loop / task.
+ * Equivalent to shell_run_budget(sh, SHELL_RUN_BUDGET).
  */
 void shell_run(shell_t *sh);
 
-/** Get runtime stats (ART usage, overflow, history) */
+/**
+ * Process up to max_bytes queued characters in one call.
+ * Output produced while doing so is flushed once at the end. getc_f is
+ * only polled (once) when the queue was empty, or while a resumable
+ * command runs, so a blocking getchar doesn't hold back output.
+ * Returns the number of input bytes consumed.
+ */
+uint16_t shell_run_budget(shell_t *sh, uint16_t max_bytes);
+
+/** Get runtime stats (ART usage, overflow, history, metrics) */
 void shell_get_stats(shell_t *sh, shell_stats_t *out);
 
+#if SHELL_ENABLE_METRICS
+/**
+ * Tick or cycle source for command timing (e.g. a DWT cycle counter).
+ * Without one, commands are counted but not timed.
+ */
+void shell_set_metrics_clock(shell_t *sh, shell_clock_func now);
+
+/**
+ * Counters of the command at `index` in the loaded table (or its id,
+ * for a set loaded from spans).
+ * Returns false past SHELL_METRICS_MAX_CMDS or the table's end.
+ */
+bool shell_get_cmd_metrics(shell_t *sh, uint16_t index, shell_cmd_metrics_t *out);
+
+/** Zero all metrics counters */
+void shell_reset_metrics(shell_t *sh);
+#endif
+
+/**
+ * Ready-made "stats" command: prints shell_get_stats() and, with
+ * SHELL_ENABLE_METRICS, the hot-path and per-command counters through
+ * shell_printf(). Put it in a table with the session as user_data:
+ *   SHELL_CMD("stats", "Show shell statistics", shell_cmd_stats, &g_shell)
+ */
+int shell_cmd_stats(int argc, char **argv, void *user_data);
+
 /**
  * Register a custom key binding.
  * Handler returns true if key was handled (prevents default behavior).
+ * Modified keys are bound as e.g. SHELL_KEY_MOD(SHELL_KEY_LEFT,
+ * SHELL_MOD_CTRL) or SHELL_KEY_ALT('x'). Returns false when the table
+ * is full or SHELL_FEATURE_KEYBINDS is 0.
  */
 bool shell_bind_key(shell_t *sh, shell_key_t key, 
                     shell_key_handler handler, void *user_data);
@@ -316,10 +1143,30 @@ bool shell_get_echo(shell_t *sh);
 void shell_insert_text(shell_t *sh, const char *text);
 
 /**
- * Redraw the current line (useful for custom key handlers)
+ * Redraw the current line (useful for custom key handlers). A wrapped
+ * line is repainted from its first row.
  */
 void shell_redraw_line(shell_t *sh);
 
+/**
+ * Width the terminal wraps at. Once known, long lines are edited across
+ * rows: cursor moves go up and down, and an edit only repaints the rows
+ * it shifts. Set it again after a resize. 0 goes back to one-row drawing.
+ * Without SHELL_FEATURE_WRAP the line is always one row.
+ */
+void shell_set_term_width(shell_t *sh, uint16_t cols);
+
+/** Current wrap width, 0 if unknown */
+uint16_t shell_get_term_width(const shell_t *sh);
+
+/**
+ * Ask the terminal for its width: the cursor is parked in the last
+ * column and a position report (ESC[6n) requested, and the reply sets
+ * the width when it comes back through the input. Done once with the
+ * first prompt unless SHELL_TERM_QUERY is 0.
+ */
+void shell_query_term_width(shell_t *sh);
+
 /**
  * Get current line buffer (useful for completion handlers).
  */
@@ -335,6 +1182,21 @@ void shell_clear_screen(shell_t *sh);
  */
 void shell_add_history(shell_t *sh, const char *line);
 
+/**
+ * Attach a persistent history store and replay its log into the history
+ * ring. Call right after shell_init(); replay reads the log once, so the
+ * cost is bounded by store->size. From then on each new entry is
+ * appended as one record, and the region is erased and rewritten from
+ * the ring only when the log is full. A torn or corrupt tail is dropped
+ * and triggers that compaction on the next add; a reset during the
+ * compaction itself loses the entries not yet rewritten. A failed
+ * append marks the log full, so the next add compacts it (a torn record
+ * would hide every later one at replay). A failed erase, or a failed
+ * append while compacting, detaches the store, so history stays
+ * RAM-only until it is attached again. Pass NULL to detach.
+ */
+void shell_set_history_store(shell_t *sh, const shell_history_store_t *store);
+
 /**
  * Get a specific history entry.
  * @param sh Shell instance
@@ -0,0 +1,93 @@
+/*
+ * shell_trie_gen - build the command trie on the host and emit it as a
+ * const byte array, so the target can use shell_load_prebuilt_trie() and
+ * keep the whole trie in flash.
+ *
+ * Usage: shell_trie_gen <names.txt> <out.c> <symbol>
+ *
+ * names.txt holds one command name per line, in the same order as the
+ * entries of the shell_ext_cmd_t table it describes. Blank lines and
+ * lines starting with '#' are skipped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shell.h"
+
+static shell_cmdset_t g_set;
+
+static char *trim(char *s)
+{
+    size_t n = strlen(s);
+    while (n && (s[n - 1] == '\n' || s[n - 1] == '\r' || s[n - 1] == ' ' || s[n - 1] == '\t'))
+        s[--n] = '\0';
+    while (*s == ' ' || *s == '\t') s++;
+    return s;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <names.txt> <out.c> <symbol>\n", argv[0]);
+        return 2;
+    }
+
+    FILE *in = fopen(argv[1], "r");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    shell_ext_cmd_t *table = NULL;
+    size_t count = 0, cap = 0;
+    char line[1024];
+    while (fgets(line, sizeof line, in)) {
+        char *name = trim(line);
+        if (!*name || *name == '#') continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            table = realloc(table, cap * sizeof *table);
+            if (!table) { fclose(in); return 1; }
+        }
+        size_t len = strlen(name) + 1;
+        char *copy = malloc(len);
+        if (!copy) { fclose(in); return 1; }
+        memcpy(copy, name, len);
+        memset(&table[count], 0, sizeof table[count]);
+        table[count].name = copy;
+        count++;
+    }
+    fclose(in);
+
+    if (count == 0 || count > 0x7FFF) {
+        fprintf(stderr, "%s: need 1..32767 command names, got %zu\n", argv[1], count);
+        return 1;
+    }
+
+    if (shell_cmdset_load_table(&g_set, table, (uint16_t)count) != SHELL_OK) {
+        fprintf(stderr, "%s: trie does not fit the generator's arena\n", argv[1]);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    fprintf(out, "/* Generated by shell_trie_gen from %s. Do not edit. */\n", argv[1]);
+    fprintf(out, "#include \"shell.h\"\n\n");
+    fprintf(out, "static const uint8_t %s_arena[%u] = {", argv[3], g_set.art_used);
+    for (uint16_t i = 0; i < g_set.art_used; i++)
+        fprintf(out, "%s0x%02X,", (i % 12) ? " " : "\n    ", g_set.art_arena[i]);
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "const shell_art_prebuilt_t %s = {\n", argv[3]);
+    fprintf(out, "    %s_arena, %u, %u, %u, %zu\n};\n",
+            argv[3], g_set.art_used, g_set.art_root, g_set.art_max_used, count);
+
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    return 0;
+}